@@ -0,0 +1,469 @@
+#include "fs.h"
+#include "disk.h"
+#include "crc32c.h"
+#include "blockhash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/*
+Benchmarks for the filesystem hot paths. Each workload runs against a
+freshly formatted image: anything it needs is set up first, then the
+counters are reset and only the measured part is timed. Latency
+percentiles and per-operation disk traffic come from fs_stats. Every
+result is printed and appended to a CSV file, so runs from different
+builds can be compared row by row.
+
+Workloads are seeded, so the same options always do the same work.
+*/
+
+#define BENCH_CSV      "bench.csv"
+#define BENCH_IO_SIZE  (16*DISK_BLOCK_SIZE)
+#define BENCH_FILE_MB  64
+#define BENCH_RANDOM   4096
+#define BENCH_FILES    2000
+#define BENCH_MOUNTS   5
+#define BENCH_SMALL_MAX (4*DISK_BLOCK_SIZE)
+
+struct workload {
+	const char *name;
+	void (*setup)();
+	long long (*run)();	/* returns logical bytes moved */
+};
+
+static int filesize;
+static int iosize = BENCH_IO_SIZE;
+static int nrandom = BENCH_RANDOM;
+static int nfiles = BENCH_FILES;
+static unsigned long long seed = 1;
+static char *buffer;
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* xorshift64: the same sequence everywhere, whatever the libc. */
+static unsigned long long next_random()
+{
+	seed ^= seed<<13;
+	seed ^= seed>>7;
+	seed ^= seed<<17;
+	return seed;
+}
+
+/*
+Log lines for compressed images, which are meant for data like this.
+Random bytes would never compress.
+*/
+static void fill_text( char *data, int length )
+{
+	static const char *levels[] = {"INFO","INFO","INFO","DEBUG","WARN","ERROR"};
+	char line[128];
+	int n, done = 0;
+
+	while(done<length) {
+		n = snprintf(line,sizeof(line),"2026-10-17 %02d:%02d:%02d.%03d %-5s worker-%d request %llu done in %llu ms status=%d\n",
+			(int)(next_random()%24),(int)(next_random()%60),(int)(next_random()%60),(int)(next_random()%1000),
+			levels[next_random()%6],(int)(next_random()%16),next_random()%1000000,next_random()%500,
+			next_random()%8 ? 200 : 500);
+		if(n>length-done) n = length-done;
+		memcpy(data+done,line,n);
+		done += n;
+	}
+}
+
+static void fresh_image()
+{
+	fs_unmount();
+	if(!fs_format() || !fs_mount()) {
+		printf("couldn't format and mount the benchmark image\n");
+		exit(1);
+	}
+}
+
+static void fill_file( int inumber )
+{
+	int offset;
+	for(offset=0;offset<filesize;offset+=iosize) {
+		fs_write(inumber,buffer,iosize,offset);
+	}
+}
+
+/* One big file, written and read in iosize pieces. */
+
+static void setup_seqwrite()
+{
+	fresh_image();
+	fs_create();
+}
+
+static long long run_seqwrite()
+{
+	fill_file(1);
+	fs_sync();
+	return filesize;
+}
+
+static void setup_file()
+{
+	fresh_image();
+	fill_file(fs_create());
+	fs_sync();
+}
+
+static long long run_seqread()
+{
+	long long total = 0;
+	int offset, n;
+
+	for(offset=0;offset<filesize;offset+=n) {
+		n = fs_read(1,buffer,iosize,offset);
+		if(n<=0) break;
+		total += n;
+	}
+	return total;
+}
+
+/* Single blocks at random within the same file. */
+
+static long long run_randread()
+{
+	long long total = 0;
+	int i, nblocks = filesize/DISK_BLOCK_SIZE;
+
+	for(i=0;i<nrandom;i++) {
+		total += fs_read(1,buffer,DISK_BLOCK_SIZE,(int64_t)(next_random()%nblocks)*DISK_BLOCK_SIZE);
+	}
+	return total;
+}
+
+static long long run_randwrite()
+{
+	long long total = 0;
+	int i, nblocks = filesize/DISK_BLOCK_SIZE;
+
+	for(i=0;i<nrandom;i++) {
+		total += fs_write(1,buffer,DISK_BLOCK_SIZE,(int64_t)(next_random()%nblocks)*DISK_BLOCK_SIZE);
+	}
+	fs_sync();
+	return total;
+}
+
+/* Empty files created and deleted as fast as possible. */
+
+static void setup_empty()
+{
+	fresh_image();
+}
+
+static long long run_createdelete()
+{
+	int i, *inumbers = malloc(nfiles*sizeof(int));
+
+	for(i=0;i<nfiles;i++) inumbers[i] = fs_create();
+	for(i=0;i<nfiles;i++) fs_delete(inumbers[i]);
+	fs_sync();
+	free(inumbers);
+	return 0;
+}
+
+/* Clean mounts of an image holding nfiles small files. */
+
+static void setup_mount()
+{
+	int i;
+
+	fresh_image();
+	for(i=0;i<nfiles;i++) {
+		fs_write(fs_create(),buffer,1+next_random()%BENCH_SMALL_MAX,0);
+	}
+	fs_unmount();
+}
+
+static long long run_mount()
+{
+	int i;
+
+	for(i=0;i<BENCH_MOUNTS;i++) {
+		fs_mount();
+		fs_unmount();
+	}
+	fs_mount();
+	return 0;
+}
+
+/*
+A mix of small files: each round creates one, writes up to
+BENCH_SMALL_MAX bytes, reads it back, and deletes a random earlier
+file half the time.
+*/
+
+static long long run_smallfile()
+{
+	int *inumbers = malloc(nfiles*sizeof(int));
+	int i, n, size, live = 0;
+	long long total = 0;
+
+	for(i=0;i<nfiles;i++) {
+		size = 1+next_random()%BENCH_SMALL_MAX;
+		inumbers[live] = fs_create();
+		total += fs_write(inumbers[live],buffer,size,0);
+		total += fs_read(inumbers[live],buffer,size,0);
+		live++;
+		if(next_random()%2) {
+			n = next_random()%live;
+			fs_delete(inumbers[n]);
+			inumbers[n] = inumbers[--live];
+		}
+	}
+	fs_sync();
+	free(inumbers);
+	return total;
+}
+
+/*
+The checksum kernels on their own, a block at a time over as many bytes
+as the big file holds, for comparison with the read workloads: every
+block fs_read takes from the disk is checked once. Likewise the block
+fingerprints, taken of every block written to a deduplicating image.
+*/
+
+static void setup_none()
+{
+}
+
+static long long run_checksum( uint32_t (*kernel)( uint32_t, const void *, size_t ) )
+{
+	long long total = 0;
+	uint32_t crc = 0;
+	int offset;
+
+	while(total<filesize) {
+		for(offset=0;offset+DISK_BLOCK_SIZE<=iosize && total<filesize;offset+=DISK_BLOCK_SIZE) {
+			crc ^= kernel(0,buffer+offset,DISK_BLOCK_SIZE);
+			total += DISK_BLOCK_SIZE;
+		}
+	}
+	buffer[0] ^= crc&1;
+	return total;
+}
+
+static long long run_crc32c()
+{
+	return run_checksum(crc32c);
+}
+
+static long long run_crc32c_soft()
+{
+	return run_checksum(crc32c_soft);
+}
+
+static long long run_fingerprint( uint64_t (*kernel)( const void *, size_t ) )
+{
+	long long total = 0;
+	uint64_t hash = 0;
+	int offset;
+
+	while(total<filesize) {
+		for(offset=0;offset+DISK_BLOCK_SIZE<=iosize && total<filesize;offset+=DISK_BLOCK_SIZE) {
+			hash ^= kernel(buffer+offset,DISK_BLOCK_SIZE);
+			total += DISK_BLOCK_SIZE;
+		}
+	}
+	buffer[0] ^= hash&1;
+	return total;
+}
+
+static long long run_blockhash()
+{
+	return run_fingerprint(blockhash);
+}
+
+static long long run_blockhash_soft()
+{
+	return run_fingerprint(blockhash_soft);
+}
+
+static struct workload workloads[] = {
+	{"seqwrite",       setup_seqwrite, run_seqwrite},
+	{"seqread",        setup_file,     run_seqread},
+	{"randread",       setup_file,     run_randread},
+	{"randwrite",      setup_file,     run_randwrite},
+	{"createdelete",   setup_empty,    run_createdelete},
+	{"mount",          setup_mount,    run_mount},
+	{"smallfile",      setup_empty,    run_smallfile},
+	{"crc32c",         setup_none,     run_crc32c},
+	{"crc32c_soft",    setup_none,     run_crc32c_soft},
+	{"blockhash",      setup_none,     run_blockhash},
+	{"blockhash_soft", setup_none,     run_blockhash_soft},
+};
+
+#define NWORKLOADS ((int)(sizeof(workloads)/sizeof(workloads[0])))
+
+static void run( struct workload *w, FILE *csv, const char *label )
+{
+	struct fs_stats stats;
+	struct fs_op_stats all;
+	double started, elapsed, ops, mb, p50, p99, reads, writes;
+	long long bytes;
+	int i, b;
+
+	w->setup();
+	fs_stats_reset();
+	started = now();
+	bytes = w->run();
+	elapsed = now()-started;
+	fs_stats(&stats);
+
+	/* Fold the calls of every kind into one set of figures. */
+	memset(&all,0,sizeof(all));
+	for(i=0;i<FS_NOPS;i++) {
+		all.calls += stats.ops[i].calls;
+		if(stats.ops[i].max_ns>all.max_ns) all.max_ns = stats.ops[i].max_ns;
+		for(b=0;b<FS_STATS_BUCKETS;b++) all.histogram[b] += stats.ops[i].histogram[b];
+	}
+
+	/* Disk traffic per call includes journal commits and cache write-back. */
+	ops = all.calls/elapsed;
+	mb = bytes/elapsed/1e6;
+	p50 = fs_stats_percentile(&all,50);
+	p99 = fs_stats_percentile(&all,99);
+	reads = all.calls ? stats.physical_read_bytes/(double)DISK_BLOCK_SIZE/all.calls : 0;
+	writes = all.calls ? stats.physical_write_bytes/(double)DISK_BLOCK_SIZE/all.calls : 0;
+
+	printf("%-14s %9lld %9.3f %11.0f %9.1f %9.1f %9.1f %9.2f %9.2f\n",
+		w->name,all.calls,elapsed,ops,mb,p50,p99,reads,writes);
+	fprintf(csv,"%ld,%s,%s,%d,%lld,%.6f,%.1f,%.3f,%.1f,%.1f,%.4f,%.4f\n",
+		(long)time(0),label,w->name,disk_size(),all.calls,elapsed,ops,mb,p50,p99,reads,writes);
+	fflush(csv);
+}
+
+static void usage( const char *name )
+{
+	int i;
+
+	printf("use: %s [-o csvfile] [-l label] [-m] [-d] [-a] [-k] [-z] [-u] [-f filemb] [-i iosize] [-r randomops] [-n files] [-s seed]\n",name);
+	printf("          <diskfile> <nblocks> [workload ...]\n");
+	printf("workloads:");
+	for(i=0;i<NWORKLOADS;i++) printf(" %s",workloads[i].name);
+	printf("\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *csvname = BENCH_CSV;
+	const char *label = "build";
+	int backend = DISK_BACKEND_FILE;
+	int filemb = BENCH_FILE_MB;
+	int compress = 0;
+	int dedup = 0;
+	int nextfit = 0;
+	int opt, i, j, nblocks;
+	FILE *csv;
+
+	while((opt=getopt(argc,argv,"o:l:mdakzuf:i:r:n:s:"))!=-1) {
+		switch(opt) {
+			case 'o': csvname = optarg; break;
+			case 'l': label = optarg; break;
+			case 'm': backend = DISK_BACKEND_MMAP; break;
+			case 'd': fs_set_delalloc(0); break;
+			case 'a': nextfit = 1; break;
+			case 'k': fs_set_verify(0); break;
+			case 'z': compress = 1; break;
+			case 'u': dedup = 1; break;
+			case 'f': filemb = atoi(optarg); break;
+			case 'i': iosize = atoi(optarg); break;
+			case 'r': nrandom = atoi(optarg); break;
+			case 'n': nfiles = atoi(optarg); break;
+			case 's': seed = strtoull(optarg,0,0); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(argc-optind<2 || iosize<=0 || nfiles<=0 || seed==0) {
+		usage(argv[0]);
+		return 1;
+	}
+	nblocks = atoi(argv[optind+1]);
+	for(j=optind+2;j<argc;j++) {
+		for(i=0;i<NWORKLOADS;i++) if(!strcmp(argv[j],workloads[i].name)) break;
+		if(i==NWORKLOADS) {
+			printf("unknown workload: %s\n",argv[j]);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* Keep the big file to well under half the disk, whole iosize pieces. */
+	filesize = filemb*1024*1024;
+	if(filesize/DISK_BLOCK_SIZE>nblocks*2/5) filesize = nblocks*2/5*DISK_BLOCK_SIZE;
+	filesize = filesize/iosize*iosize;
+	if(filesize<=0) {
+		printf("%d blocks is too small for %d byte I/O\n",nblocks,iosize);
+		return 1;
+	}
+
+	buffer = malloc(iosize>BENCH_SMALL_MAX ? iosize : BENCH_SMALL_MAX);
+	fs_set_dedup(dedup);
+	fs_set_alloc_mode(nextfit ? FS_ALLOC_NEXTFIT : FS_ALLOC_EXTENT);
+	if(compress) {
+		fs_set_compression(FS_COMPRESS_LZ);
+		fill_text(buffer,iosize>BENCH_SMALL_MAX ? iosize : BENCH_SMALL_MAX);
+	} else {
+		for(i=0;i<iosize || i<BENCH_SMALL_MAX;i++) buffer[i] = next_random();
+	}
+
+	if(!disk_init_backend(argv[optind],nblocks,backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+	if(!disk_async_init(DISK_ASYNC_AUTO)) {
+		printf("couldn't start the async disk engine\n");
+		return 1;
+	}
+
+	/* New files get a header; existing ones just grow. */
+	csv = fopen(csvname,"a");
+	if(!csv) {
+		printf("couldn't open %s: %s\n",csvname,strerror(errno));
+		return 1;
+	}
+	if(ftell(csv)==0) {
+		fprintf(csv,"time,label,workload,nblocks,ops,seconds,ops_per_s,mb_per_s,p50_us,p99_us,reads_per_op,writes_per_op\n");
+	}
+
+	/* The filesystem logs every write; keep the report readable
+	 * but let its errors through. */
+	fs_set_verbose(0);
+	setvbuf(stdout,0,_IOLBF,0);
+
+	printf("%d blocks, %d MB file, %d byte I/O, %d random ops, %d files, %s checksums, %s fingerprints%s%s%s\n",
+		nblocks,filesize>>20,iosize,nrandom,nfiles,crc32c_kernel(),blockhash_kernel(),
+		compress ? ", compressed text" : "",dedup ? ", deduplicated" : "",
+		nextfit ? ", next-fit allocation" : "");
+	printf("%-14s %9s %9s %11s %9s %9s %9s %9s %9s\n",
+		"workload","ops","seconds","ops/s","MB/s","p50 us","p99 us","reads/op","writes/op");
+
+	for(i=0;i<NWORKLOADS;i++) {
+		if(optind+2<argc) {
+			for(j=optind+2;j<argc;j++) if(!strcmp(argv[j],workloads[i].name)) break;
+			if(j==argc) continue;
+		}
+		run(&workloads[i],csv,label);
+	}
+
+	fs_unmount();
+	disk_close();
+	fclose(csv);
+	printf("results appended to %s\n",csvname);
+	return 0;
+}
@@ -0,0 +1,247 @@
+
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS 64
+
+// Threads working on disjoint words share the free count
+#define ADJUST_FREE(map, n) __atomic_add_fetch(&(map)->nfree, (n), __ATOMIC_RELAXED)
+
+int bitmap_init( struct bitmap *map, int nbits ){
+
+    map->nbits  = nbits;
+    map->nwords = (nbits + WORD_BITS - 1) / WORD_BITS;
+    map->nfree  = nbits;
+    map->cursor = 0;
+    map->dirty  = 0;
+    map->chunk_words = 0;
+    map->words  = calloc(map->nwords ? map->nwords : 1, sizeof(uint64_t));
+    if(!map->words) return 0;
+
+    // Pad the tail of the last word with used bits so scans never return
+    // an index past the end of the map
+    if(nbits % WORD_BITS)
+        map->words[map->nwords - 1] = ~0ULL << (nbits % WORD_BITS);
+
+    return 1;
+}
+
+void bitmap_destroy( struct bitmap *map ){
+    free(map->words);
+    free(map->dirty);
+    memset(map, 0, sizeof(*map));
+}
+
+void bitmap_recount( struct bitmap *map ){
+
+    // Recompute the free count after the words were filled in directly
+    int used = 0;
+    for(int w = 0; w < map->nwords; w++)
+        used += __builtin_popcountll(map->words[w]);
+    map->nfree = map->nbits - (used - (map->nwords * WORD_BITS - map->nbits));
+}
+
+int bitmap_track( struct bitmap *map, int chunk_words ){
+
+    // Remember which chunk_words-sized pieces of the map change, so a
+    // persistent copy only needs the changed pieces written back
+    free(map->dirty);
+    map->chunk_words = chunk_words;
+    map->dirty = calloc(bitmap_nchunks(map), 1);
+    return map->dirty != 0;
+}
+
+int bitmap_nchunks( const struct bitmap *map ){
+    return map->chunk_words ? (map->nwords + map->chunk_words - 1) / map->chunk_words : 0;
+}
+
+int bitmap_chunk_dirty( const struct bitmap *map, int chunk ){
+    return map->dirty && __atomic_load_n(&map->dirty[chunk], __ATOMIC_ACQUIRE);
+}
+
+void bitmap_chunk_clean( struct bitmap *map, int chunk ){
+    if(map->dirty) __atomic_store_n(&map->dirty[chunk], 0, __ATOMIC_RELEASE);
+}
+
+void bitmap_dirty_all( struct bitmap *map ){
+    if(map->dirty) memset(map->dirty, 1, bitmap_nchunks(map));
+}
+
+static void mark_dirty( struct bitmap *map, int w ){
+    if(map->dirty) __atomic_store_n(&map->dirty[w / map->chunk_words], 1, __ATOMIC_RELEASE);
+}
+
+int bitmap_test( const struct bitmap *map, int i ){
+    return (map->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+void bitmap_set( struct bitmap *map, int i ){
+    uint64_t bit = 1ULL << (i % WORD_BITS);
+    if(map->words[i / WORD_BITS] & bit) return;
+    map->words[i / WORD_BITS] |= bit;
+    ADJUST_FREE(map, -1);
+    mark_dirty(map, i / WORD_BITS);
+}
+
+void bitmap_clear( struct bitmap *map, int i ){
+    uint64_t bit = 1ULL << (i % WORD_BITS);
+    if(!(map->words[i / WORD_BITS] & bit)) return;
+    map->words[i / WORD_BITS] &= ~bit;
+    ADJUST_FREE(map, 1);
+    mark_dirty(map, i / WORD_BITS);
+}
+
+// Mask of bits [lo, hi) within a single word
+static uint64_t word_mask( int lo, int hi ){
+    uint64_t upper = hi >= WORD_BITS ? ~0ULL : (1ULL << hi) - 1;
+    return upper & (~0ULL << lo);
+}
+
+void bitmap_set_range( struct bitmap *map, int start, int count ){
+
+    int end = start + count;
+    while(start < end){
+        int w  = start / WORD_BITS;
+        int lo = start % WORD_BITS;
+        int hi = end - w * WORD_BITS < WORD_BITS ? end - w * WORD_BITS : WORD_BITS;
+        uint64_t mask = word_mask(lo, hi);
+        ADJUST_FREE(map, -__builtin_popcountll(mask & ~map->words[w]));
+        map->words[w] |= mask;
+        mark_dirty(map, w);
+        start = w * WORD_BITS + hi;
+    }
+}
+
+void bitmap_clear_range( struct bitmap *map, int start, int count ){
+
+    int end = start + count;
+    while(start < end){
+        int w  = start / WORD_BITS;
+        int lo = start % WORD_BITS;
+        int hi = end - w * WORD_BITS < WORD_BITS ? end - w * WORD_BITS : WORD_BITS;
+        uint64_t mask = word_mask(lo, hi);
+        ADJUST_FREE(map, __builtin_popcountll(mask & map->words[w]));
+        map->words[w] &= ~mask;
+        mark_dirty(map, w);
+        start = w * WORD_BITS + hi;
+    }
+}
+
+void bitmap_merge( struct bitmap *map, const struct bitmap *other ){
+
+    // OR another map of the same size into this one, a word at a time
+    for(int w = 0; w < map->nwords; w++){
+        if(other->words[w] & ~map->words[w]) mark_dirty(map, w);
+        map->words[w] |= other->words[w];
+    }
+    bitmap_recount(map);
+}
+
+int bitmap_next_clear( const struct bitmap *map, int from ){
+    return bitmap_next_clear_in(map, from, map->nbits);
+}
+
+int bitmap_next_set( const struct bitmap *map, int from ){
+    return bitmap_next_set_in(map, from, map->nbits);
+}
+
+int bitmap_next_clear_in( const struct bitmap *map, int from, int hi ){
+
+    // Returns the first clear bit in [from, hi), or hi if none. No word
+    // past the one holding bit hi-1 is looked at.
+    if(from >= hi) return hi;
+    int w = from / WORD_BITS;
+    int last = (hi - 1) / WORD_BITS;
+    uint64_t free_bits = ~map->words[w] & (~0ULL << (from % WORD_BITS));
+    while(!free_bits){
+        if(++w > last) return hi;
+        free_bits = ~map->words[w];
+    }
+    int i = w * WORD_BITS + __builtin_ctzll(free_bits);
+    return i < hi ? i : hi;
+}
+
+int bitmap_next_set_in( const struct bitmap *map, int from, int hi ){
+
+    // Returns the first set bit in [from, hi), or hi if none
+    if(from >= hi) return hi;
+    int w = from / WORD_BITS;
+    int last = (hi - 1) / WORD_BITS;
+    uint64_t used_bits = map->words[w] & (~0ULL << (from % WORD_BITS));
+    while(!used_bits){
+        if(++w > last) return hi;
+        used_bits = map->words[w];
+    }
+    int i = w * WORD_BITS + __builtin_ctzll(used_bits);
+    return i < hi ? i : hi;
+}
+
+int bitmap_alloc( struct bitmap *map ){
+
+    // Next-fit: resume scanning where the last allocation left off and
+    // wrap around to the start once
+    if(!map->nfree) return -1;
+    int i = bitmap_next_clear(map, map->cursor);
+    if(i >= map->nbits) i = bitmap_next_clear(map, 0);
+    if(i >= map->nbits) return -1;
+
+    bitmap_set(map, i);
+    map->cursor = i + 1 < map->nbits ? i + 1 : 0;
+    return i;
+}
+
+int bitmap_alloc_range( struct bitmap *map, int lo, int hi, int *cursor ){
+
+    // Next-fit within [lo, hi) using the caller's cursor, so independent
+    // parts of one map can be handed out by different threads
+    if(*cursor < lo || *cursor >= hi) *cursor = lo;
+    int i = bitmap_next_clear_in(map, *cursor, hi);
+    if(i >= hi) i = bitmap_next_clear_in(map, lo, hi);
+    if(i >= hi) return -1;
+
+    bitmap_set(map, i);
+    *cursor = i + 1 < hi ? i + 1 : lo;
+    return i;
+}
+
+void bitmap_rewind( struct bitmap *map, int i ){
+
+    // Move the next-fit cursor back to i if it's past it. A map whose
+    // cursor is only ever rewound to freed bits allocates lowest-first.
+    if(i >= 0 && i < map->cursor) map->cursor = i;
+}
+
+int bitmap_alloc_run( struct bitmap *map, int lo, int hi, int count, int *length ){
+
+    // Allocate count contiguous bits from the smallest free run within
+    // [lo, hi) that holds them. If nothing is big enough, take the largest
+    // run instead so the caller can come back for the rest. *length gets
+    // the number of bits allocated (at most count). Returns the first of
+    // them, or -1 if the range is full.
+    int best = -1, best_len = 0;
+    int i = lo;
+    while(i < hi){
+        int start = bitmap_next_clear_in(map, i, hi);
+        if(start >= hi) break;
+        int stop = bitmap_next_set_in(map, start, hi);
+        int len  = stop - start;
+        if(len == count){
+            best = start;
+            best_len = len;
+            break;
+        }
+        if(best < 0
+           || (len > count && (best_len < count || len < best_len))
+           || (len < count && best_len < count && len > best_len)){
+            best = start;
+            best_len = len;
+        }
+        i = stop;
+    }
+    if(best_len > count) best_len = count;
+    if(best >= 0) bitmap_set_range(map, best, best_len);
+    if(length) *length = best_len;
+    return best;
+}
@@ -0,0 +1,45 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+// Bit-packed allocation map: bit i set means item i is in use
+struct bitmap {
+    uint64_t *words;
+    int nbits;
+    int nwords;
+    int nfree;
+    int cursor;
+    unsigned char *dirty;   // per-chunk change flags, if tracking
+    int chunk_words;        // words per tracked chunk
+};
+
+int  bitmap_init( struct bitmap *map, int nbits );
+void bitmap_destroy( struct bitmap *map );
+void bitmap_recount( struct bitmap *map );
+
+int  bitmap_track( struct bitmap *map, int chunk_words );
+int  bitmap_nchunks( const struct bitmap *map );
+int  bitmap_chunk_dirty( const struct bitmap *map, int chunk );
+void bitmap_chunk_clean( struct bitmap *map, int chunk );
+void bitmap_dirty_all( struct bitmap *map );
+
+int  bitmap_test( const struct bitmap *map, int i );
+void bitmap_set( struct bitmap *map, int i );
+void bitmap_clear( struct bitmap *map, int i );
+void bitmap_set_range( struct bitmap *map, int start, int count );
+void bitmap_clear_range( struct bitmap *map, int start, int count );
+
+void bitmap_merge( struct bitmap *map, const struct bitmap *other );
+
+int  bitmap_next_clear( const struct bitmap *map, int from );
+int  bitmap_next_set( const struct bitmap *map, int from );
+int  bitmap_next_clear_in( const struct bitmap *map, int from, int hi );
+int  bitmap_next_set_in( const struct bitmap *map, int from, int hi );
+
+int  bitmap_alloc( struct bitmap *map );
+int  bitmap_alloc_range( struct bitmap *map, int lo, int hi, int *cursor );
+void bitmap_rewind( struct bitmap *map, int i );
+int  bitmap_alloc_run( struct bitmap *map, int lo, int hi, int count, int *length );
+
+#endif
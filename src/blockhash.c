@@ -0,0 +1,184 @@
+#include "blockhash.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BLOCKHASH_SIMD 1
+#endif
+
+#define STRIPE   64             // bytes taken by one round of the lanes
+#define ROUND    16             // stripes between scrambles
+#define LANES    8
+
+#define PRIME32   0x9E3779B1u
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0x165667919E3779F9ull
+
+// Per-lane keys: stripe s of a round is keyed with SECRET[s..s+7], and
+// the scramble after each round with the last eight
+static uint64_t SECRET[ROUND + LANES];
+static pthread_once_t ONCE = PTHREAD_ONCE_INIT;
+
+// A kernel takes up to ROUND stripes and folds them into the lanes
+struct kernel {
+    const char *name;
+    void (*accumulate)( uint64_t *acc, const unsigned char *p, int nstripes );
+    void (*scramble)( uint64_t *acc );
+};
+
+static const struct kernel *KERNEL;
+
+static void accumulate_soft( uint64_t *acc, const unsigned char *p, int nstripes ){
+    for(int s = 0; s < nstripes; s++, p += STRIPE){
+        for(int i = 0; i < LANES; i++){
+            uint64_t v;
+            memcpy(&v, p + 8 * i, 8);
+            uint64_t k = v ^ SECRET[s + i];
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xffffffff) * (k >> 32);
+        }
+    }
+}
+
+static void scramble_soft( uint64_t *acc ){
+    for(int i = 0; i < LANES; i++){
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= SECRET[ROUND + i];
+        acc[i] *= PRIME32;
+    }
+}
+
+static const struct kernel SOFT = {"scalar", accumulate_soft, scramble_soft};
+
+#ifdef BLOCKHASH_SIMD
+static void accumulate_sse2( uint64_t *acc, const unsigned char *p, int nstripes ){
+
+    // Two lanes per register. mul_epu32 multiplies the low halves of
+    // each lane, so the key mix is multiplied by itself shifted down.
+    __m128i a[4];
+    for(int i = 0; i < 4; i++) a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+    for(int s = 0; s < nstripes; s++, p += STRIPE){
+        for(int i = 0; i < 4; i++){
+            __m128i v = _mm_loadu_si128((const __m128i *)p + i);
+            __m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)(SECRET + s + 2 * i)));
+            __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm_add_epi64(a[i], product);
+        }
+    }
+    for(int i = 0; i < 4; i++) _mm_storeu_si128((__m128i *)acc + i, a[i]);
+}
+
+static void scramble_sse2( uint64_t *acc ){
+    __m128i prime = _mm_set1_epi32(PRIME32);
+    for(int i = 0; i < 4; i++){
+        __m128i a = _mm_loadu_si128((const __m128i *)acc + i);
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(SECRET + ROUND + 2 * i)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2( uint64_t *acc, const unsigned char *p, int nstripes ){
+    __m256i a[2];
+    for(int i = 0; i < 2; i++) a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+    for(int s = 0; s < nstripes; s++, p += STRIPE){
+        for(int i = 0; i < 2; i++){
+            __m256i v = _mm256_loadu_si256((const __m256i *)p + i);
+            __m256i k = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)(SECRET + s + 4 * i)));
+            __m256i product = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm256_add_epi64(a[i], product);
+        }
+    }
+    for(int i = 0; i < 2; i++) _mm256_storeu_si256((__m256i *)acc + i, a[i]);
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2( uint64_t *acc ){
+    __m256i prime = _mm256_set1_epi32(PRIME32);
+    for(int i = 0; i < 2; i++){
+        __m256i a = _mm256_loadu_si256((const __m256i *)acc + i);
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(SECRET + ROUND + 4 * i)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        _mm256_storeu_si256((__m256i *)acc + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+    }
+}
+
+static const struct kernel SSE2 = {"sse2", accumulate_sse2, scramble_sse2};
+static const struct kernel AVX2 = {"avx2", accumulate_avx2, scramble_avx2};
+#endif
+
+static uint64_t fold( uint64_t a, uint64_t b ){
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t hash_with( const struct kernel *k, const void *data, size_t length ){
+
+    // Whole rounds, then the stripes left over, then any bytes left
+    // after that as one zero-padded stripe
+    uint64_t acc[LANES] = {PRIME32, PRIME64_1, PRIME64_2, PRIME32 ^ PRIME64_1,
+                           PRIME64_2 ^ PRIME32, PRIME64_1 + PRIME64_2, PRIME64_1 ^ PRIME32, PRIME64_2 - PRIME32};
+    const unsigned char *p = data;
+    size_t nstripes = length / STRIPE;
+    for(; nstripes >= ROUND; nstripes -= ROUND, p += ROUND * STRIPE){
+        k->accumulate(acc, p, ROUND);
+        k->scramble(acc);
+    }
+    k->accumulate(acc, p, nstripes);
+    p += nstripes * STRIPE;
+    if(length % STRIPE){
+        unsigned char last[STRIPE] = {0};
+        memcpy(last, p, length % STRIPE);
+        k->accumulate(acc, last, 1);
+    }
+
+    uint64_t h = length * PRIME64_1;
+    for(int i = 0; i < LANES; i += 2)
+        h += fold(acc[i] ^ SECRET[i], acc[i + 1] ^ SECRET[i + 1]);
+    h ^= h >> 37;
+    h *= PRIME64_2;
+    return h ^ (h >> 32);
+}
+
+static void blockhash_init(){
+
+    // The keys come from splitmix64, so every build agrees on them
+    uint64_t seed = 0x5eed0f5f5eed0f5full;
+    for(int i = 0; i < ROUND + LANES; i++){
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        SECRET[i] = z ^ (z >> 31);
+    }
+
+    KERNEL = &SOFT;
+#ifdef BLOCKHASH_SIMD
+    KERNEL = &SSE2;
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) KERNEL = &AVX2;
+#endif
+}
+
+uint64_t blockhash( const void *data, size_t length ){
+    pthread_once(&ONCE, blockhash_init);
+    return hash_with(KERNEL, data, length);
+}
+
+uint64_t blockhash_soft( const void *data, size_t length ){
+    pthread_once(&ONCE, blockhash_init);
+    return hash_with(&SOFT, data, length);
+}
+
+const char *blockhash_kernel(){
+    pthread_once(&ONCE, blockhash_init);
+    return KERNEL->name;
+}
@@ -0,0 +1,17 @@
+#ifndef BLOCKHASH_H
+#define BLOCKHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit fingerprints of data blocks for deduplication. Eight 64-bit
+// lanes take a 64-byte stripe at a time, in the style of XXH3's long
+// input loop, so the same sum comes out of an AVX2, SSE2 or plain C
+// kernel; the fastest the CPU has is used. Not cryptographic: callers
+// compare the data itself before trusting a match.
+
+uint64_t blockhash( const void *data, size_t length );
+uint64_t blockhash_soft( const void *data, size_t length );
+const char *blockhash_kernel();
+
+#endif
@@ -0,0 +1,172 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+#define POLY 0x82f63b78         // CRC-32C, bit-reflected
+
+// The hardware kernel runs three independent streams over adjacent
+// stretches of LONG (then SHORT) bytes and folds them together with the
+// zeros tables, which advance a CRC over that many zero bytes. LONG and
+// SHORT must be powers of two.
+#define LONG  8192
+#define SHORT 256
+
+static uint32_t TABLE[8][256];
+static uint32_t ZEROS_LONG[4][256];
+static uint32_t ZEROS_SHORT[4][256];
+static uint32_t (*KERNEL)( uint32_t crc, const void *data, size_t length );
+static pthread_once_t ONCE = PTHREAD_ONCE_INIT;
+
+static void crc32c_init();
+
+static uint32_t gf2_matrix_times( const uint32_t *mat, uint32_t vec ){
+    uint32_t sum = 0;
+    for(; vec; vec >>= 1, mat++)
+        if(vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square( uint32_t *square, const uint32_t *mat ){
+    for(int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static void zeros_op( uint32_t *even, size_t length ){
+
+    // Build the operator that feeds length zero bytes through a CRC,
+    // by squaring the one-zero-bit operator log2(8 * length) times
+    uint32_t odd[32];
+    odd[0] = POLY;
+    for(int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_matrix_square(even, odd);       // two zero bits
+    gf2_matrix_square(odd, even);       // four
+    do {
+        gf2_matrix_square(even, odd);
+        length >>= 1;
+        if(!length) return;
+        gf2_matrix_square(odd, even);
+        length >>= 1;
+    } while(length);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zeros_table( uint32_t zeros[4][256], size_t length ){
+    uint32_t op[32];
+    zeros_op(op, length);
+    for(uint32_t n = 0; n < 256; n++){
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t shift( uint32_t zeros[4][256], uint32_t crc ){
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+         ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+uint32_t crc32c_soft( uint32_t crc, const void *data, size_t length ){
+
+    // Slicing-by-8: eight table lookups per eight bytes. Assumes a
+    // little-endian CPU, like the rest of the on-disk format.
+    pthread_once(&ONCE, crc32c_init);
+    const unsigned char *p = data;
+    crc = ~crc;
+    while(length && ((uintptr_t)p & 7)){
+        crc = TABLE[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+    for(; length >= 8; p += 8, length -= 8){
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = TABLE[7][word & 0xff] ^ TABLE[6][(word >> 8) & 0xff]
+            ^ TABLE[5][(word >> 16) & 0xff] ^ TABLE[4][(word >> 24) & 0xff]
+            ^ TABLE[3][(word >> 32) & 0xff] ^ TABLE[2][(word >> 40) & 0xff]
+            ^ TABLE[1][(word >> 48) & 0xff] ^ TABLE[0][word >> 56];
+    }
+    while(length--)
+        crc = TABLE[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard( uint32_t crc, const void *data, size_t length ){
+
+    // The crc32 instruction takes three cycles but can start one every
+    // cycle, so three streams keep it busy
+    const unsigned char *p = data;
+    uint64_t crc0 = ~crc;
+    while(length && ((uintptr_t)p & 7)){
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        length--;
+    }
+    for(int pass = 0; pass < 2; pass++){
+        size_t span = pass ? SHORT : LONG;
+        uint32_t (*zeros)[256] = pass ? ZEROS_SHORT : ZEROS_LONG;
+        while(length >= 3 * span){
+            uint64_t crc1 = 0, crc2 = 0, word;
+            const unsigned char *end = p + span;
+            do {
+                memcpy(&word, p, 8);
+                crc0 = _mm_crc32_u64(crc0, word);
+                memcpy(&word, p + span, 8);
+                crc1 = _mm_crc32_u64(crc1, word);
+                memcpy(&word, p + 2 * span, 8);
+                crc2 = _mm_crc32_u64(crc2, word);
+                p += 8;
+            } while(p < end);
+            crc0 = shift(zeros, crc0) ^ crc1;
+            crc0 = shift(zeros, crc0) ^ crc2;
+            p += 2 * span;
+            length -= 3 * span;
+        }
+    }
+    for(; length >= 8; p += 8, length -= 8){
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+    while(length--)
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    return ~(uint32_t)crc0;
+}
+#endif
+
+static void crc32c_init(){
+    for(uint32_t n = 0; n < 256; n++){
+        uint32_t crc = n;
+        for(int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        TABLE[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; n++)
+        for(int k = 1; k < 8; k++)
+            TABLE[k][n] = TABLE[0][TABLE[k - 1][n] & 0xff] ^ (TABLE[k - 1][n] >> 8);
+    zeros_table(ZEROS_LONG, LONG);
+    zeros_table(ZEROS_SHORT, SHORT);
+
+    KERNEL = crc32c_soft;
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) KERNEL = crc32c_hard;
+#endif
+}
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length ){
+    pthread_once(&ONCE, crc32c_init);
+    return KERNEL(crc, data, length);
+}
+
+const char *crc32c_kernel(){
+    pthread_once(&ONCE, crc32c_init);
+    return KERNEL == crc32c_soft ? "slicing-by-8" : "sse4.2";
+}
@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs. Uses the
+// SSE4.2 crc32 instruction when the CPU has it, three streams at a time,
+// and a slicing-by-8 table otherwise. Pass 0 to start a new checksum, or
+// a previous result to continue one.
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length );
+uint32_t crc32c_soft( uint32_t crc, const void *data, size_t length );
+const char *crc32c_kernel();
+
+#endif
@@ -0,0 +1,119 @@
+#include "csum.h"
+#include "crc32c.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Region read per request when loading the table
+#define CSUM_BATCH_BLOCKS 8
+
+uint32_t *CSUM_TABLE = 0;   // one entry per block, padded to whole region blocks
+char *CSUM_DIRTY = 0;       // per region block: changed since the last flush
+int CSUM_START = 0;
+int CSUM_NREGION = 0;
+int CSUM_NBLOCKS = 0;
+int CSUM_VERIFY = 1;
+long long CSUM_ERRORS = 0;
+
+static uint32_t block_sum( const char *data ){
+
+    // Zero is kept to mean "not recorded"
+    uint32_t sum = crc32c(0, data, DISK_BLOCK_SIZE);
+    return sum ? sum : 1;
+}
+
+int csum_load( int start, int nregion, int nblocks ){
+
+    // Read the whole table in; the caller has checked the region exists
+    csum_unload();
+    CSUM_TABLE = malloc((size_t)nregion * DISK_BLOCK_SIZE);
+    CSUM_DIRTY = calloc(nregion, 1);
+    if(!CSUM_TABLE || !CSUM_DIRTY){
+        csum_unload();
+        return 0;
+    }
+    for(int i = 0; i < nregion; i += CSUM_BATCH_BLOCKS){
+        int count = nregion - i < CSUM_BATCH_BLOCKS ? nregion - i : CSUM_BATCH_BLOCKS;
+        disk_submit_read(start + i, count, (char *)(CSUM_TABLE + (size_t)i * CSUMS_PER_BLOCK), 0, 0);
+    }
+    disk_drain();
+    CSUM_START = start;
+    CSUM_NREGION = nregion;
+    CSUM_NBLOCKS = nblocks;
+    return 1;
+}
+
+void csum_reset(){
+
+    // Forget every recorded checksum, on disk too at the next flush
+    memset(CSUM_TABLE, 0, (size_t)CSUM_NREGION * DISK_BLOCK_SIZE);
+    memset(CSUM_DIRTY, 1, CSUM_NREGION);
+}
+
+void csum_unload(){
+    free(CSUM_TABLE);
+    free(CSUM_DIRTY);
+    CSUM_TABLE = 0;
+    CSUM_DIRTY = 0;
+    CSUM_NBLOCKS = 0;
+}
+
+int csum_active(){
+    return CSUM_TABLE != 0;
+}
+
+void csum_set_verify( int on ){
+    CSUM_VERIFY = on;
+}
+
+int csum_verifying(){
+    return CSUM_TABLE && CSUM_VERIFY;
+}
+
+void csum_update( int blocknum, int count, const char *data ){
+
+    // Record the checksums of count blocks about to be written
+    if(!CSUM_TABLE) return;
+    for(int i = 0; i < count; i++){
+        int b = blocknum + i;
+        if(b < 0 || b >= CSUM_NBLOCKS) continue;
+        __atomic_store_n(&CSUM_TABLE[b], block_sum(data + (size_t)i * DISK_BLOCK_SIZE), __ATOMIC_RELAXED);
+        __atomic_store_n(&CSUM_DIRTY[b / CSUMS_PER_BLOCK], 1, __ATOMIC_RELEASE);
+    }
+}
+
+int csum_check( int blocknum, int count, const char *data ){
+
+    // Check count blocks just read, and return how many at the front
+    // match what was recorded
+    if(!csum_verifying()) return count;
+    for(int i = 0; i < count; i++){
+        int b = blocknum + i;
+        if(b < 0 || b >= CSUM_NBLOCKS) continue;
+        uint32_t want = __atomic_load_n(&CSUM_TABLE[b], __ATOMIC_RELAXED);
+        if(!want || want == block_sum(data + (size_t)i * DISK_BLOCK_SIZE)) continue;
+        __atomic_add_fetch(&CSUM_ERRORS, 1, __ATOMIC_RELAXED);
+        printf("ERROR: Checksum mismatch in block %d\n", b);
+        return i;
+    }
+    return count;
+}
+
+void csum_flush( void (*write)( int blocknum, const char *data ) ){
+
+    // Write back each block of the table that changed since last time
+    for(int i = 0; i < CSUM_NREGION && CSUM_TABLE; i++){
+        if(!__atomic_exchange_n(&CSUM_DIRTY[i], 0, __ATOMIC_ACQ_REL)) continue;
+        uint32_t block[CSUMS_PER_BLOCK];
+        for(int k = 0; k < CSUMS_PER_BLOCK; k++)
+            block[k] = __atomic_load_n(&CSUM_TABLE[(size_t)i * CSUMS_PER_BLOCK + k], __ATOMIC_RELAXED);
+        write(CSUM_START + i, (const char *)block);
+    }
+}
+
+long long csum_errors(){
+    return __atomic_load_n(&CSUM_ERRORS, __ATOMIC_RELAXED);
+}
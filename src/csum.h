@@ -0,0 +1,27 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+// Per-block checksums. Every block has a CRC32C entry in a table that
+// stays resident while mounted and lives in its own region on disk,
+// written back through the journal with the rest of the metadata. fs.c
+// and the pointer cache record a block's checksum when they write it
+// and check it when they read it back. Only data and pointer blocks are
+// recorded; the metadata regions are covered by the journal's own
+// checksum. An entry of zero means nothing has been recorded, and any
+// contents check out against it.
+
+#define CSUMS_PER_BLOCK 1024
+
+int  csum_load( int start, int nregion, int nblocks );
+void csum_reset();
+void csum_unload();
+int  csum_active();
+void csum_set_verify( int on );
+int  csum_verifying();
+
+void csum_update( int blocknum, int count, const char *data );
+int  csum_check( int blocknum, int count, const char *data );
+void csum_flush( void (*write)( int blocknum, const char *data ) );
+long long csum_errors();
+
+#endif
@@ -0,0 +1,220 @@
+#include "dedup.h"
+#include "disk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Region read per request when loading the table
+#define DEDUP_BATCH_BLOCKS 8
+
+struct dedup_entry {
+    uint64_t hash;
+    uint32_t refs;
+    uint32_t reserved;
+};
+
+// The table has one entry per block, padded to whole region blocks. The
+// index is open-addressed with linear probing and holds block numbers,
+// 0 for an empty slot; a fingerprint shared by several blocks is only
+// indexed once. DEDUP_LOCK covers both.
+struct dedup_entry *DEDUP_TABLE = 0;
+char *DEDUP_DIRTY = 0;      // per region block: changed since the last flush
+int *DEDUP_INDEX = 0;
+unsigned DEDUP_MASK = 0;
+int DEDUP_START = 0;
+int DEDUP_NREGION = 0;
+int DEDUP_NBLOCKS = 0;
+pthread_mutex_t DEDUP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned home_slot( uint64_t hash ){
+    return (unsigned)(hash ^ (hash >> 32)) & DEDUP_MASK;
+}
+
+static int index_find( uint64_t hash ){
+    for(unsigned h = home_slot(hash); DEDUP_INDEX[h]; h = (h + 1) & DEDUP_MASK)
+        if(DEDUP_TABLE[DEDUP_INDEX[h]].hash == hash) return DEDUP_INDEX[h];
+    return 0;
+}
+
+static void index_add( int blocknum ){
+    uint64_t hash = DEDUP_TABLE[blocknum].hash;
+    unsigned h = home_slot(hash);
+    for(; DEDUP_INDEX[h]; h = (h + 1) & DEDUP_MASK)
+        if(DEDUP_TABLE[DEDUP_INDEX[h]].hash == hash) return;
+    DEDUP_INDEX[h] = blocknum;
+}
+
+static void index_remove( int blocknum ){
+
+    // Take the block out, if it is the one indexed for its fingerprint,
+    // and pull later entries of the probe run back over the gap. Called
+    // before its entry changes.
+    unsigned i = home_slot(DEDUP_TABLE[blocknum].hash);
+    for(; DEDUP_INDEX[i] != blocknum; i = (i + 1) & DEDUP_MASK)
+        if(!DEDUP_INDEX[i]) return;
+    for(unsigned j = (i + 1) & DEDUP_MASK; DEDUP_INDEX[j]; j = (j + 1) & DEDUP_MASK){
+        unsigned k = home_slot(DEDUP_TABLE[DEDUP_INDEX[j]].hash);
+        if(((j - k) & DEDUP_MASK) >= ((j - i) & DEDUP_MASK)){
+            DEDUP_INDEX[i] = DEDUP_INDEX[j];
+            i = j;
+        }
+    }
+    DEDUP_INDEX[i] = 0;
+}
+
+static void entry_dirty( int blocknum ){
+    DEDUP_DIRTY[blocknum / DEDUP_PER_BLOCK] = 1;
+}
+
+int dedup_load( int start, int nregion, int nblocks ){
+
+    // Read the whole table in and index every block that has an entry
+    dedup_unload();
+    unsigned nslots = 1024;
+    while(nslots < (unsigned)nblocks * 2) nslots *= 2;
+    DEDUP_TABLE = malloc((size_t)nregion * DISK_BLOCK_SIZE);
+    DEDUP_DIRTY = calloc(nregion, 1);
+    DEDUP_INDEX = calloc(nslots, sizeof(int));
+    if(!DEDUP_TABLE || !DEDUP_DIRTY || !DEDUP_INDEX){
+        dedup_unload();
+        return 0;
+    }
+    for(int i = 0; i < nregion; i += DEDUP_BATCH_BLOCKS){
+        int count = nregion - i < DEDUP_BATCH_BLOCKS ? nregion - i : DEDUP_BATCH_BLOCKS;
+        disk_submit_read(start + i, count, (char *)(DEDUP_TABLE + (size_t)i * DEDUP_PER_BLOCK), 0, 0);
+    }
+    disk_drain();
+    DEDUP_MASK = nslots - 1;
+    DEDUP_START = start;
+    DEDUP_NREGION = nregion;
+    DEDUP_NBLOCKS = nblocks;
+    for(int b = 1; b < nblocks; b++)
+        if(DEDUP_TABLE[b].refs) index_add(b);
+    return 1;
+}
+
+void dedup_reset(){
+
+    // Drop every entry and the index, on disk too at the next flush
+    pthread_mutex_lock(&DEDUP_LOCK);
+    memset(DEDUP_TABLE, 0, (size_t)DEDUP_NREGION * DISK_BLOCK_SIZE);
+    memset(DEDUP_DIRTY, 1, DEDUP_NREGION);
+    memset(DEDUP_INDEX, 0, ((size_t)DEDUP_MASK + 1) * sizeof(int));
+    pthread_mutex_unlock(&DEDUP_LOCK);
+}
+
+void dedup_unload(){
+    free(DEDUP_TABLE);
+    free(DEDUP_DIRTY);
+    free(DEDUP_INDEX);
+    DEDUP_TABLE = 0;
+    DEDUP_DIRTY = 0;
+    DEDUP_INDEX = 0;
+    DEDUP_NBLOCKS = 0;
+}
+
+int dedup_active(){
+    return DEDUP_TABLE != 0;
+}
+
+int dedup_lookup( uint64_t hash ){
+
+    // A block that held these contents when it was recorded, or 0
+    pthread_mutex_lock(&DEDUP_LOCK);
+    int b = index_find(hash);
+    pthread_mutex_unlock(&DEDUP_LOCK);
+    return b;
+}
+
+int dedup_share( int blocknum, uint64_t hash ){
+
+    // Take another reference to a block found by dedup_lookup, unless it
+    // has been rewritten or freed since
+    pthread_mutex_lock(&DEDUP_LOCK);
+    struct dedup_entry *e = &DEDUP_TABLE[blocknum];
+    int ok = e->refs && e->hash == hash;
+    if(ok){
+        e->refs++;
+        entry_dirty(blocknum);
+    }
+    pthread_mutex_unlock(&DEDUP_LOCK);
+    return ok;
+}
+
+int dedup_claim( int blocknum, uint64_t hash ){
+
+    // Before a block is rewritten in place with new contents: returns 0
+    // if other files share it, and it has to be copied instead
+    pthread_mutex_lock(&DEDUP_LOCK);
+    struct dedup_entry *e = &DEDUP_TABLE[blocknum];
+    int ok = e->refs <= 1;
+    if(ok){
+        if(e->refs) index_remove(blocknum);
+        e->hash = hash;
+        e->refs = 1;
+        index_add(blocknum);
+        entry_dirty(blocknum);
+    }
+    pthread_mutex_unlock(&DEDUP_LOCK);
+    return ok;
+}
+
+void dedup_record( int blocknum, uint64_t hash ){
+
+    // A newly allocated block, once its contents are written
+    pthread_mutex_lock(&DEDUP_LOCK);
+    struct dedup_entry *e = &DEDUP_TABLE[blocknum];
+    e->hash = hash;
+    e->refs = 1;
+    index_add(blocknum);
+    entry_dirty(blocknum);
+    pthread_mutex_unlock(&DEDUP_LOCK);
+}
+
+int dedup_release( int blocknum ){
+
+    // Drop a file's reference to a data block. Returns 1 if that was the
+    // last one and the block can be freed; always, without a table.
+    if(!DEDUP_TABLE || blocknum >= DEDUP_NBLOCKS) return 1;
+    pthread_mutex_lock(&DEDUP_LOCK);
+    struct dedup_entry *e = &DEDUP_TABLE[blocknum];
+    int last = e->refs <= 1;
+    if(e->refs > 1){
+        e->refs--;
+        entry_dirty(blocknum);
+    } else if(e->refs){
+        index_remove(blocknum);
+        memset(e, 0, sizeof(*e));
+        entry_dirty(blocknum);
+    }
+    pthread_mutex_unlock(&DEDUP_LOCK);
+    return last;
+}
+
+void dedup_flush( void (*write)( int blocknum, const char *data ) ){
+
+    // Write back each block of the table that changed since last time
+    for(int i = 0; i < DEDUP_NREGION && DEDUP_TABLE; i++){
+        struct dedup_entry block[DEDUP_PER_BLOCK];
+        pthread_mutex_lock(&DEDUP_LOCK);
+        int dirty = DEDUP_DIRTY[i];
+        DEDUP_DIRTY[i] = 0;
+        if(dirty) memcpy(block, DEDUP_TABLE + (size_t)i * DEDUP_PER_BLOCK, sizeof(block));
+        pthread_mutex_unlock(&DEDUP_LOCK);
+        if(dirty) write(DEDUP_START + i, (const char *)block);
+    }
+}
+
+void dedup_summary( long long *shared, long long *saved ){
+
+    // Blocks with more than one reference, and the blocks that saves
+    *shared = *saved = 0;
+    pthread_mutex_lock(&DEDUP_LOCK);
+    for(int b = 0; b < DEDUP_NBLOCKS; b++){
+        if(DEDUP_TABLE[b].refs < 2) continue;
+        (*shared)++;
+        *saved += DEDUP_TABLE[b].refs - 1;
+    }
+    pthread_mutex_unlock(&DEDUP_LOCK);
+}
@@ -0,0 +1,32 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+// Block deduplication. On a deduplicating image every data block fs.c
+// writes has an entry in a table that stays resident while mounted and
+// lives in its own region on disk, written back through the journal with
+// the rest of the metadata: the block's fingerprint and how many file
+// pointers lead to it. An index from fingerprint to block, rebuilt from
+// the table at mount, finds a block that may already hold what is about
+// to be written; fs.c compares the contents before sharing it. A count
+// of zero means the block has no entry and belongs to whichever one file
+// points at it.
+
+#define DEDUP_PER_BLOCK 256
+
+int  dedup_load( int start, int nregion, int nblocks );
+void dedup_reset();
+void dedup_unload();
+int  dedup_active();
+
+int  dedup_lookup( uint64_t hash );
+int  dedup_share( int blocknum, uint64_t hash );
+int  dedup_claim( int blocknum, uint64_t hash );
+void dedup_record( int blocknum, uint64_t hash );
+int  dedup_release( int blocknum );
+
+void dedup_flush( void (*write)( int blocknum, const char *data ) );
+void dedup_summary( long long *shared, long long *saved );
+
+#endif
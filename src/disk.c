@@ -4,27 +4,153 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+/* Most blocks moved by a single preadv/pwritev call. */
+#define DISK_IOV_MAX 256
+
+/* Worker threads used when io_uring isn't available. */
+#define DISK_ASYNC_WORKERS 4
+
+/* Counters are bumped from worker threads as well as the caller's. */
+#define COUNT(counter,n) __atomic_add_fetch(&(counter),(n),__ATOMIC_RELAXED)
+
+/*
+A frame of the block cache.  Frames holding a block are chained
+into a hash bucket by block number; empty frames have blocknum -1.
+The referenced bit drives CLOCK replacement, and dirty frames are
+written back when evicted, on disk_sync, and on disk_close.
+*/
+
+struct disk_frame {
+	int blocknum;
+	int dirty;
+	int referenced;
+	struct disk_frame *next;
+	char data[DISK_BLOCK_SIZE];
+};
+
+static int diskfd=-1;
+static char *diskmap=0;
+static int backend=DISK_BACKEND_FILE;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int nreadcalls=0;
+static int nwritecalls=0;
+
+static struct disk_frame *frames=0;
+static struct disk_frame **buckets=0;
+static int nframes=0;
+static int nbuckets=0;
+static int clock_hand=0;
+static int nhits=0;
+static int nmisses=0;
+static int nevictions=0;
+
+/* Blocks the calling thread has asked for, cache hits included. */
+static __thread long long threadreads=0;
+static __thread long long threadwrites=0;
+
+/*
+The readahead helper shares the disk with the caller's thread, so the
+cache and counters are only touched while holding disklock.
+*/
+
+static pthread_mutex_t disklock = PTHREAD_MUTEX_INITIALIZER;
+
+static void physical_write( int blocknum, const char *data );
+static void async_wait_overlap( int blocknum, int count );
+static void async_close();
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_backend(filename,n,DISK_BACKEND_FILE);
+}
+
+int disk_init_backend( const char *filename, int n, int b )
+{
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE);
+
+	backend = b;
+	if(backend==DISK_BACKEND_MMAP) {
+		diskmap = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(diskmap==MAP_FAILED) {
+			diskmap = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nreadcalls = 0;
+	nwritecalls = 0;
+	nhits = 0;
+	nmisses = 0;
+	nevictions = 0;
+
+	return disk_cache_init(DISK_CACHE_FRAMES);
+}
+
+int disk_cache_init( int n )
+{
+	int i;
+
+	if(n<0) return 0;
+
+	disk_sync();
+
+	// The page cache already does this job for a mapped image
+	if(backend==DISK_BACKEND_MMAP) n = 0;
+
+	free(frames);
+	free(buckets);
+	frames = 0;
+	buckets = 0;
+	nframes = 0;
+	nbuckets = 0;
+	clock_hand = 0;
+
+	if(n==0) return 1;
+
+	// Keep the chains short: at least two buckets per frame, rounded
+	// up to a power of two so the hash is a mask.
+	for(nbuckets=1; nbuckets<2*n; nbuckets*=2) {}
+
+	frames = malloc(n*sizeof(*frames));
+	buckets = calloc(nbuckets,sizeof(*buckets));
+	if(!frames || !buckets) {
+		free(frames);
+		free(buckets);
+		frames = 0;
+		buckets = 0;
+		nbuckets = 0;
+		return 0;
+	}
+
+	for(i=0;i<n;i++) {
+		frames[i].blocknum = -1;
+		frames[i].dirty = 0;
+		frames[i].referenced = 0;
+		frames[i].next = 0;
+	}
+	nframes = n;
 
 	return 1;
 }
@@ -52,41 +178,857 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+static void io_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
+
+/*
+Move count consecutive blocks starting at blocknum to or from the
+given buffers with as few preadv/pwritev calls as possible.
+*/
+
+static void physical_io( int blocknum, int count, char * const *data, int writing )
+{
+	struct iovec iov[DISK_IOV_MAX];
+	off_t offset;
+	ssize_t result, want;
+	int i, n, first;
+
+	if(writing) {
+		COUNT(nwrites,count);
+	} else {
+		COUNT(nreads,count);
+	}
+
+	if(diskmap) {
+		for(i=0;i<count;i++) {
+			char *block = diskmap+(size_t)(blocknum+i)*DISK_BLOCK_SIZE;
+			if(writing) {
+				memcpy(block,data[i],DISK_BLOCK_SIZE);
+			} else {
+				memcpy(data[i],block,DISK_BLOCK_SIZE);
+			}
+		}
+		if(writing) {
+			COUNT(nwritecalls,1);
+		} else {
+			COUNT(nreadcalls,1);
+		}
+		return;
+	}
+
+	for(first=0;first<count;first+=n) {
+		n = count-first;
+		if(n>DISK_IOV_MAX) n = DISK_IOV_MAX;
+
+		for(i=0;i<n;i++) {
+			iov[i].iov_base = data[first+i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		offset = (off_t)(blocknum+first)*DISK_BLOCK_SIZE;
+		want = (ssize_t)n*DISK_BLOCK_SIZE;
+
+		// Short transfers are retried from where they stopped.
+		i = 0;
+		while(want>0) {
+			if(writing) {
+				result = pwritev(diskfd,iov+i,n-i,offset);
+				COUNT(nwritecalls,1);
+			} else {
+				result = preadv(diskfd,iov+i,n-i,offset);
+				COUNT(nreadcalls,1);
+			}
+			if(result<0 && errno==EINTR) continue;
+			if(result<=0) io_error();
+
+			offset += result;
+			want -= result;
+			while(i<n && result>=(ssize_t)iov[i].iov_len) {
+				result -= iov[i].iov_len;
+				i++;
+			}
+			if(i<n) {
+				iov[i].iov_base = (char*)iov[i].iov_base+result;
+				iov[i].iov_len -= result;
+			}
+		}
+	}
+}
+
+static void physical_io_buffer( int blocknum, int count, char *data, int writing )
+{
+	char *ptrs[DISK_IOV_MAX];
+	int i, n;
+
+	for(;count>0;count-=n) {
+		n = count<DISK_IOV_MAX ? count : DISK_IOV_MAX;
+		for(i=0;i<n;i++) ptrs[i] = data+(size_t)i*DISK_BLOCK_SIZE;
+		physical_io(blocknum,n,ptrs,writing);
+		blocknum += n;
+		data += (size_t)n*DISK_BLOCK_SIZE;
+	}
+}
+
+static void physical_read( int blocknum, char *data )
+{
+	physical_io(blocknum,1,&data,0);
+}
+
+static void physical_write( int blocknum, const char *data )
+{
+	char *p = (char*)data;
+	physical_io(blocknum,1,&p,1);
+}
+
+static struct disk_frame **cache_bucket( int blocknum )
+{
+	return &buckets[(unsigned)blocknum & (nbuckets-1)];
+}
+
+static struct disk_frame *cache_lookup( int blocknum )
+{
+	struct disk_frame *f;
+
+	if(!nframes) return 0;
+
+	for(f=*cache_bucket(blocknum);f;f=f->next) {
+		if(f->blocknum==blocknum) return f;
+	}
+
+	return 0;
+}
+
+static void cache_unlink( struct disk_frame *f )
+{
+	struct disk_frame **p;
+
+	for(p=cache_bucket(f->blocknum);*p;p=&(*p)->next) {
+		if(*p==f) {
+			*p = f->next;
+			break;
+		}
+	}
+	f->next = 0;
+}
+
+/*
+Claim a frame for blocknum using the CLOCK algorithm.
+A victim holding dirty data is written back before reuse.
+*/
+
+static struct disk_frame *cache_claim( int blocknum )
+{
+	struct disk_frame *f, **b;
+
+	while(1) {
+		f = &frames[clock_hand];
+		clock_hand = (clock_hand+1)%nframes;
+		if(f->blocknum<0) break;
+		if(!f->referenced) break;
+		f->referenced = 0;
+	}
+
+	if(f->blocknum>=0) {
+		if(f->dirty) physical_write(f->blocknum,f->data);
+		cache_unlink(f);
+		nevictions++;
+	}
+
+	b = cache_bucket(blocknum);
+	f->blocknum = blocknum;
+	f->dirty = 0;
+	f->referenced = 1;
+	f->next = *b;
+	*b = f;
+
+	return f;
+}
+
 void disk_read( int blocknum, char *data )
 {
+	struct disk_frame *f;
+
 	sanity_check(blocknum,data);
+	async_wait_overlap(blocknum,1);
+	threadreads++;
+
+	pthread_mutex_lock(&disklock);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!nframes) {
+		physical_read(blocknum,data);
+		pthread_mutex_unlock(&disklock);
+		return;
+	}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	f = cache_lookup(blocknum);
+	if(f) {
+		nhits++;
+		f->referenced = 1;
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		nmisses++;
+		f = cache_claim(blocknum);
+		physical_read(blocknum,f->data);
 	}
+
+	memcpy(data,f->data,DISK_BLOCK_SIZE);
+
+	pthread_mutex_unlock(&disklock);
 }
 
 void disk_write( int blocknum, const char *data )
 {
+	struct disk_frame *f;
+
+	sanity_check(blocknum,data);
+	async_wait_overlap(blocknum,1);
+	threadwrites++;
+
+	pthread_mutex_lock(&disklock);
+
+	if(!nframes) {
+		physical_write(blocknum,data);
+		pthread_mutex_unlock(&disklock);
+		return;
+	}
+
+	// A write replaces the whole block, so a miss needs no fill.
+	f = cache_lookup(blocknum);
+	if(f) {
+		nhits++;
+		f->referenced = 1;
+	} else {
+		nmisses++;
+		f = cache_claim(blocknum);
+	}
+
+	memcpy(f->data,data,DISK_BLOCK_SIZE);
+	f->dirty = 1;
+
+	pthread_mutex_unlock(&disklock);
+}
+
+/*
+Vectored transfers of count consecutive blocks into or out of
+separate buffers.  Blocks already in the cache are served from it;
+the rest go to the disk in as few calls as possible without being
+cached, so bulk data doesn't push metadata out of the cache.
+*/
+
+void disk_readv( int blocknum, int count, char * const *data )
+{
+	struct disk_frame *f;
+	int i, run;
+
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+	async_wait_overlap(blocknum,count);
+	threadreads += count;
+
+	pthread_mutex_lock(&disklock);
+
+	i = 0;
+	while(i<count) {
+		f = cache_lookup(blocknum+i);
+		if(f) {
+			nhits++;
+			f->referenced = 1;
+			memcpy(data[i],f->data,DISK_BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		for(run=1;i+run<count;run++) {
+			if(cache_lookup(blocknum+i+run)) break;
+		}
+		if(nframes) nmisses += run;
+
+		physical_io(blocknum+i,run,data+i,0);
+		i += run;
+	}
+
+	pthread_mutex_unlock(&disklock);
+}
+
+void disk_writev( int blocknum, int count, const char * const *data )
+{
+	struct disk_frame *f;
+	int i;
+
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+	async_wait_overlap(blocknum,count);
+	threadwrites += count;
+
+	pthread_mutex_lock(&disklock);
+
+	// Any cached copy is about to be overwritten, dirty or not.
+	for(i=0;i<count;i++) {
+		f = cache_lookup(blocknum+i);
+		if(f) {
+			cache_unlink(f);
+			f->blocknum = -1;
+			f->dirty = 0;
+			f->referenced = 0;
+		}
+	}
+
+	physical_io(blocknum,count,(char * const *)data,1);
+
+	pthread_mutex_unlock(&disklock);
+}
+
+void disk_read_blocks( int blocknum, int count, char *data )
+{
+	char *ptrs[DISK_IOV_MAX];
+	int i, n;
+
+	for(;count>0;count-=n) {
+		n = count<DISK_IOV_MAX ? count : DISK_IOV_MAX;
+		for(i=0;i<n;i++) ptrs[i] = data+(size_t)i*DISK_BLOCK_SIZE;
+		disk_readv(blocknum,n,ptrs);
+		blocknum += n;
+		data += (size_t)n*DISK_BLOCK_SIZE;
+	}
+}
+
+void disk_write_blocks( int blocknum, int count, const char *data )
+{
+	const char *ptrs[DISK_IOV_MAX];
+	int i, n;
+
+	for(;count>0;count-=n) {
+		n = count<DISK_IOV_MAX ? count : DISK_IOV_MAX;
+		for(i=0;i<n;i++) ptrs[i] = data+(size_t)i*DISK_BLOCK_SIZE;
+		disk_writev(blocknum,n,ptrs);
+		blocknum += n;
+		data += (size_t)n*DISK_BLOCK_SIZE;
+	}
+}
+
+/*
+Asynchronous requests.  Each one moves count consecutive blocks to or
+from a contiguous buffer.  They are carried out by io_uring when the
+kernel allows it and by a small pool of worker threads otherwise.
+Completions are collected by disk_poll or disk_drain, which run the
+callbacks in the calling thread.  The buffer must stay untouched until
+the request has completed.
+*/
+
+struct disk_request {
+	int blocknum;
+	int count;
+	int writing;
+	int slot;
+	char *data;
+	struct iovec iov;
+	disk_callback callback;
+	void *arg;
+	struct timespec submitted;
+	struct timespec completed;
+	struct disk_request *next;
+};
+
+static int engine=DISK_ASYNC_NONE;
+static pthread_mutex_t asynclock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t asyncdone = PTHREAD_COND_INITIALIZER;
+static struct disk_request *pending=0, *pending_tail=0;
+static struct disk_request *completed=0;
+static struct disk_request *inflight[DISK_QUEUE_DEPTH];
+static pthread_t workers[DISK_ASYNC_WORKERS];
+static int nworkers=0;
+static int stopping=0;
+
+static int ninflight=0;
+static int maxinflight=0;
+static int nsubmitted=0;
+static int ncompleted=0;
+static double totallatency=0;
+static double maxlatency=0;
+
+static int ringfd=-1;
+static void *sqring=0, *cqring=0;
+static size_t sqringsize=0, cqringsize=0, sqessize=0;
+static unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+static unsigned *cqhead, *cqtail, *cqmask;
+static struct io_uring_sqe *sqes=0;
+static struct io_uring_cqe *cqes=0;
+
+static double elapsed_usec( const struct timespec *a, const struct timespec *b )
+{
+	return (b->tv_sec-a->tv_sec)*1e6 + (b->tv_nsec-a->tv_nsec)/1e3;
+}
+
+static int uring_start()
+{
+	struct io_uring_params p;
+
+	memset(&p,0,sizeof(p));
+	ringfd = syscall(__NR_io_uring_setup,DISK_QUEUE_DEPTH,&p);
+	if(ringfd<0) return 0;
+
+	sqringsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cqringsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cqringsize>sqringsize) sqringsize = cqringsize;
+		cqringsize = 0;
+	}
+	sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	sqring = mmap(0,sqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+	if(sqring==MAP_FAILED) goto fail;
+	if(cqringsize) {
+		cqring = mmap(0,cqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+		if(cqring==MAP_FAILED) goto fail;
+	} else {
+		cqring = sqring;
+	}
+	sqes = mmap(0,sqessize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+	if(sqes==MAP_FAILED) goto fail;
+
+	sqhead = (unsigned*)((char*)sqring+p.sq_off.head);
+	sqtail = (unsigned*)((char*)sqring+p.sq_off.tail);
+	sqmask = (unsigned*)((char*)sqring+p.sq_off.ring_mask);
+	sqarray = (unsigned*)((char*)sqring+p.sq_off.array);
+	cqhead = (unsigned*)((char*)cqring+p.cq_off.head);
+	cqtail = (unsigned*)((char*)cqring+p.cq_off.tail);
+	cqmask = (unsigned*)((char*)cqring+p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)((char*)cqring+p.cq_off.cqes);
+
+	return 1;
+
+	fail:
+	if(sqes && sqes!=MAP_FAILED) munmap(sqes,sqessize);
+	if(cqring && cqring!=MAP_FAILED && cqring!=sqring) munmap(cqring,cqringsize);
+	if(sqring && sqring!=MAP_FAILED) munmap(sqring,sqringsize);
+	sqes = 0;
+	sqring = cqring = 0;
+	close(ringfd);
+	ringfd = -1;
+	return 0;
+}
+
+static void uring_stop()
+{
+	if(ringfd<0) return;
+	munmap(sqes,sqessize);
+	if(cqring!=sqring) munmap(cqring,cqringsize);
+	munmap(sqring,sqringsize);
+	sqes = 0;
+	sqring = cqring = 0;
+	close(ringfd);
+	ringfd = -1;
+}
+
+static void uring_submit( struct disk_request *r )
+{
+	unsigned tail = *sqtail;
+	unsigned index = tail & *sqmask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = r->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = diskfd;
+	sqe->addr = (unsigned long)&r->iov;
+	sqe->len = 1;
+	sqe->off = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+	sqe->user_data = (unsigned long)r;
+	sqarray[index] = index;
+	__atomic_store_n(sqtail,tail+1,__ATOMIC_RELEASE);
+
+	while(syscall(__NR_io_uring_enter,ringfd,1,0,0,0,0)<0) {
+		if(errno!=EINTR) io_error();
+	}
+}
+
+/*
+Move finished io_uring requests onto the completed list.
+Called with asynclock held.
+*/
+
+static int uring_reap( int wait )
+{
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	struct disk_request *r;
+	int n = 0;
+
+	while(1) {
+		head = *cqhead;
+		tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+		if(head!=tail || !wait) break;
+		if(syscall(__NR_io_uring_enter,ringfd,0,1,IORING_ENTER_GETEVENTS,0,0)<0 && errno!=EINTR) io_error();
+	}
+
+	for(;head!=tail;head++) {
+		cqe = &cqes[head & *cqmask];
+		r = (struct disk_request *)(unsigned long)cqe->user_data;
+
+		// Anything short of the whole transfer is redone synchronously.
+		if(cqe->res!=r->count*DISK_BLOCK_SIZE) {
+			physical_io_buffer(r->blocknum,r->count,r->data,r->writing);
+		} else if(r->writing) {
+			COUNT(nwrites,r->count);
+			COUNT(nwritecalls,1);
+		} else {
+			COUNT(nreads,r->count);
+			COUNT(nreadcalls,1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC,&r->completed);
+		r->next = completed;
+		completed = r;
+		n++;
+	}
+	__atomic_store_n(cqhead,head,__ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void *async_worker( void *arg )
+{
+	struct disk_request *r;
+
+	pthread_mutex_lock(&asynclock);
+	while(1) {
+		while(!pending && !stopping) pthread_cond_wait(&asyncwork,&asynclock);
+		if(!pending) break;
+
+		r = pending;
+		pending = r->next;
+		if(!pending) pending_tail = 0;
+		pthread_mutex_unlock(&asynclock);
+
+		physical_io_buffer(r->blocknum,r->count,r->data,r->writing);
+		clock_gettime(CLOCK_MONOTONIC,&r->completed);
+
+		pthread_mutex_lock(&asynclock);
+		r->next = completed;
+		completed = r;
+		pthread_cond_broadcast(&asyncdone);
+	}
+	pthread_mutex_unlock(&asynclock);
+
+	return 0;
+}
+
+int disk_async_init( int e )
+{
+	int i;
+
+	disk_drain();
+
+	pthread_mutex_lock(&asynclock);
+
+	// Tear down whatever engine was running before.
+	stopping = 1;
+	pthread_cond_broadcast(&asyncwork);
+	pthread_mutex_unlock(&asynclock);
+	for(i=0;i<nworkers;i++) pthread_join(workers[i],0);
+	pthread_mutex_lock(&asynclock);
+	nworkers = 0;
+	stopping = 0;
+	uring_stop();
+	engine = DISK_ASYNC_NONE;
+
+	// A mapped image is just memory; requests complete as they are made.
+	if(diskmap && e!=DISK_ASYNC_NONE) e = DISK_ASYNC_INLINE;
+
+	if(e==DISK_ASYNC_AUTO || e==DISK_ASYNC_URING) {
+		if(uring_start()) {
+			engine = DISK_ASYNC_URING;
+		} else if(e==DISK_ASYNC_URING) {
+			pthread_mutex_unlock(&asynclock);
+			return 0;
+		} else {
+			e = DISK_ASYNC_THREADS;
+		}
+	}
+
+	if(e==DISK_ASYNC_THREADS) {
+		for(i=0;i<DISK_ASYNC_WORKERS;i++) {
+			if(pthread_create(&workers[i],0,async_worker,0)) break;
+		}
+		nworkers = i;
+		engine = nworkers ? DISK_ASYNC_THREADS : DISK_ASYNC_INLINE;
+	}
+
+	if(e==DISK_ASYNC_INLINE) engine = DISK_ASYNC_INLINE;
+
+	pthread_mutex_unlock(&asynclock);
+
+	return 1;
+}
+
+static void async_submit( int blocknum, int count, char *data, int writing, disk_callback callback, void *arg )
+{
+	struct disk_request *r;
+	struct disk_frame *f;
+	int i;
+
+	if(count<=0) return;
 	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(engine==DISK_ASYNC_NONE) disk_async_init(DISK_ASYNC_AUTO);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(writing) {
+		threadwrites += count;
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		threadreads += count;
+	}
+
+	r = malloc(sizeof(*r));
+	if(!r) {
+		printf("ERROR: out of memory for disk request\n");
 		abort();
 	}
+	r->blocknum = blocknum;
+	r->count = count;
+	r->writing = writing;
+	r->data = data;
+	r->iov.iov_base = data;
+	r->iov.iov_len = (size_t)count*DISK_BLOCK_SIZE;
+	r->callback = callback;
+	r->arg = arg;
+	r->next = 0;
+
+	// The request goes around the cache, so make the disk agree with it
+	// first: cached copies of blocks being written are dropped, and
+	// dirty copies of blocks being read are written back.
+	pthread_mutex_lock(&disklock);
+	for(i=0;i<count;i++) {
+		f = cache_lookup(blocknum+i);
+		if(!f) continue;
+		if(writing) {
+			cache_unlink(f);
+			f->blocknum = -1;
+			f->dirty = 0;
+			f->referenced = 0;
+		} else if(f->dirty) {
+			physical_write(f->blocknum,f->data);
+			f->dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&disklock);
+
+	// Wait for room in the queue.
+	pthread_mutex_lock(&asynclock);
+	while(ninflight>=DISK_QUEUE_DEPTH) {
+		pthread_mutex_unlock(&asynclock);
+		disk_poll(1);
+		pthread_mutex_lock(&asynclock);
+	}
+
+	for(i=0;inflight[i];i++) {}
+	inflight[i] = r;
+	r->slot = i;
+	__atomic_add_fetch(&ninflight,1,__ATOMIC_RELEASE);
+	nsubmitted++;
+	if(ninflight>maxinflight) maxinflight = ninflight;
+	clock_gettime(CLOCK_MONOTONIC,&r->submitted);
+
+	if(engine==DISK_ASYNC_URING) {
+		uring_submit(r);
+	} else if(engine==DISK_ASYNC_THREADS) {
+		if(pending_tail) {
+			pending_tail->next = r;
+		} else {
+			pending = r;
+		}
+		pending_tail = r;
+		pthread_cond_signal(&asyncwork);
+	} else {
+		physical_io_buffer(r->blocknum,r->count,r->data,r->writing);
+		clock_gettime(CLOCK_MONOTONIC,&r->completed);
+		r->next = completed;
+		completed = r;
+	}
+
+	pthread_mutex_unlock(&asynclock);
 }
 
-void disk_close()
+void disk_submit_read( int blocknum, int count, char *data, disk_callback callback, void *arg )
+{
+	async_submit(blocknum,count,data,0,callback,arg);
+}
+
+void disk_submit_write( int blocknum, int count, const char *data, disk_callback callback, void *arg )
+{
+	async_submit(blocknum,count,(char*)data,1,callback,arg);
+}
+
+int disk_poll( int wait )
+{
+	struct disk_request *list, *r, *next;
+	double latency;
+	int n = 0;
+
+	pthread_mutex_lock(&asynclock);
+
+	if(engine==DISK_ASYNC_URING) {
+		uring_reap(wait && !completed && ninflight>0);
+	} else {
+		while(wait && !completed && ninflight>0) {
+			pthread_cond_wait(&asyncdone,&asynclock);
+		}
+	}
+
+	list = completed;
+	completed = 0;
+
+	for(r=list;r;r=r->next) {
+		latency = elapsed_usec(&r->submitted,&r->completed);
+		totallatency += latency;
+		if(latency>maxlatency) maxlatency = latency;
+		inflight[r->slot] = 0;
+		__atomic_sub_fetch(&ninflight,1,__ATOMIC_RELEASE);
+		ncompleted++;
+		n++;
+	}
+
+	pthread_mutex_unlock(&asynclock);
+
+	for(r=list;r;r=next) {
+		next = r->next;
+		if(r->callback) r->callback(r->arg,r->blocknum,r->count);
+		free(r);
+	}
+
+	return n;
+}
+
+void disk_drain()
+{
+	while(__atomic_load_n(&ninflight,__ATOMIC_ACQUIRE)>0) disk_poll(1);
+}
+
+/*
+Synchronous calls see the disk as if every earlier asynchronous
+request had finished: if one is still working on any of the same
+blocks, drain the queue first.
+*/
+
+static void async_wait_overlap( int blocknum, int count )
+{
+	int i, busy = 0;
+	struct disk_request *r;
+
+	if(!__atomic_load_n(&ninflight,__ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&asynclock);
+	for(i=0;i<DISK_QUEUE_DEPTH && !busy;i++) {
+		r = inflight[i];
+		if(r && r->blocknum<blocknum+count && blocknum<r->blocknum+r->count) busy = 1;
+	}
+	pthread_mutex_unlock(&asynclock);
+
+	if(busy) disk_drain();
+}
+
+static void async_close()
+{
+	static const char *names[] = { "none", "inline", "thread pool", "io_uring" };
+
+	disk_drain();
+	if(nsubmitted) {
+		printf("%d async requests via %s, at most %d of %d in flight\n",nsubmitted,names[engine],maxinflight,DISK_QUEUE_DEPTH);
+		printf("%.1f us average, %.1f us worst async completion latency\n",totallatency/ncompleted,maxlatency);
+	}
+	disk_async_init(DISK_ASYNC_NONE);
+	nsubmitted = ncompleted = maxinflight = 0;
+	totallatency = maxlatency = 0;
+}
+
+/*
+With the mmap backend, return the address of a block inside the
+mapping so callers can read it in place.  The pointer stays valid
+until disk_close.  Returns null for the other backends.
+*/
+
+const char *disk_block_ptr( int blocknum )
+{
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	threadreads++;
+
+	COUNT(nreads,1);
+	COUNT(nreadcalls,1);
+
+	return diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+/*
+Blocks moved to and from the disk itself since disk_init, and blocks
+the calling thread has asked of this layer, whether or not the cache
+could satisfy them.
+*/
+
+void disk_counts( long long *reads, long long *writes )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	*reads = __atomic_load_n(&nreads,__ATOMIC_RELAXED);
+	*writes = __atomic_load_n(&nwrites,__ATOMIC_RELAXED);
+}
+
+void disk_thread_counts( long long *reads, long long *writes )
+{
+	*reads = threadreads;
+	*writes = threadwrites;
+}
+
+void disk_sync()
+{
+	int i;
+
+	if(diskfd<0) return;
+
+	disk_drain();
+
+	if(diskmap) {
+		msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+		return;
+	}
+
+	pthread_mutex_lock(&disklock);
+	for(i=0;i<nframes;i++) {
+		if(frames[i].blocknum>=0 && frames[i].dirty) {
+			physical_write(frames[i].blocknum,frames[i].data);
+			frames[i].dirty = 0;
+		}
 	}
+	pthread_mutex_unlock(&disklock);
+
+	/* Make it a real barrier: the journal depends on it. */
+	fdatasync(diskfd);
 }
 
+void disk_close()
+{
+	if(diskfd>=0) {
+		async_close();
+		disk_sync();
+		printf("%d disk block reads in %d calls\n",nreads,nreadcalls);
+		printf("%d disk block writes in %d calls\n",nwrites,nwritecalls);
+		if(nframes) {
+			printf("%d cache hits\n",nhits);
+			printf("%d cache misses\n",nmisses);
+			printf("%d cache evictions\n",nevictions);
+		}
+		if(diskmap) munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+		diskmap = 0;
+		close(diskfd);
+		diskfd = -1;
+		free(frames);
+		free(buckets);
+		frames = 0;
+		buckets = 0;
+		nframes = 0;
+		nbuckets = 0;
+	}
+}
@@ -2,11 +2,40 @@
 #define DISK_H
 
 #define DISK_BLOCK_SIZE 4096
+#define DISK_CACHE_FRAMES 64
+
+#define DISK_BACKEND_FILE  0
+#define DISK_BACKEND_MMAP  1
+
+#define DISK_QUEUE_DEPTH 64
+
+#define DISK_ASYNC_NONE    0
+#define DISK_ASYNC_INLINE  1
+#define DISK_ASYNC_THREADS 2
+#define DISK_ASYNC_URING   3
+#define DISK_ASYNC_AUTO    4
+
+typedef void (*disk_callback)( void *arg, int blocknum, int count );
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
+int  disk_cache_init( int nframes );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( int blocknum, int count, char * const *data );
+void disk_writev( int blocknum, int count, const char * const *data );
+void disk_read_blocks( int blocknum, int count, char *data );
+void disk_write_blocks( int blocknum, int count, const char *data );
+const char *disk_block_ptr( int blocknum );
+int  disk_async_init( int engine );
+void disk_submit_read( int blocknum, int count, char *data, disk_callback callback, void *arg );
+void disk_submit_write( int blocknum, int count, const char *data, disk_callback callback, void *arg );
+int  disk_poll( int wait );
+void disk_drain();
+void disk_counts( long long *reads, long long *writes );
+void disk_thread_counts( long long *reads, long long *writes );
+void disk_sync();
 void disk_close();
 
 
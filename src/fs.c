@@ -1,83 +1,462 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "bitmap.h"
+#include "readahead.h"
+#include "ptrcache.h"
+#include "journal.h"
+#include "stats.h"
+#include "pagebuf.h"
+#include "csum.h"
+#include "lz.h"
+#include "dedup.h"
+#include "blockhash.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
 
+// On-disk format versions. Version 0 images (the original layout) have
+// nothing after the inode blocks; version 1 adds a persistent free map;
+// version 2 widens the inode for a 64-bit size and deeper pointer trees;
+// version 3 adds a metadata journal after the free map; version 4 adds a
+// table of block checksums after the journal; version 5 can store file
+// data compressed; version 6 can share identical data blocks between
+// files, counting references in a table after the checksums; version 7
+// keeps small files' data in a region of slots after the inode table,
+// handed out to inodes as needed.
+#define FS_VERSION_ORIGINAL 0
+#define FS_VERSION_FREEMAP  1
+#define FS_VERSION_WIDE     2
+#define FS_VERSION_JOURNAL  3
+#define FS_VERSION_CHECKSUM 4
+#define FS_VERSION_COMPRESS 5
+#define FS_VERSION_DEDUP    6
+#define FS_VERSION_INLINE   7
+#define FS_VERSION          FS_VERSION_INLINE
+
+// Inode flags
+#define FS_INODE_INLINE 0x1 // data is held in an inline slot, not in blocks
+
+// Bytes of file data an inline slot can hold
+#define FS_INLINE_MAX 192
+
+// Inline data region: one slot per INLINE_INODES inodes, but never more
+// than one block per INLINE_RATIO blocks of disk or INLINE_MAX_BLOCKS in
+// all, since the whole region is kept in memory while mounted
+#define INLINE_INODES     8
+#define INLINE_RATIO      20
+#define INLINE_MAX_BLOCKS 4096
+#define INLINE_PER_BLOCK  (DISK_BLOCK_SIZE / FS_INLINE_MAX)
+
+// Compressed images store file data in clusters of CLUSTER_BLOCKS
+// logical blocks. A compressed cluster has CLUSTER_COMPRESSED in place of
+// its first block pointer, and the blocks holding the compressed data in
+// the pointers after it; the rest are 0. A cluster without the marker is
+// made of ordinary blocks and holes.
+#define CLUSTER_BLOCKS     4
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * DISK_BLOCK_SIZE)
+#define CLUSTER_COMPRESSED -2
+
+// Logical blocks reachable through each kind of pointer
+#define SINGLE_SPAN POINTERS_PER_BLOCK
+#define DOUBLE_SPAN (SINGLE_SPAN * POINTERS_PER_BLOCK)
+#define TRIPLE_SPAN (DOUBLE_SPAN * POINTERS_PER_BLOCK)
+
+#define BITMAP_WORDS_PER_BLOCK (DISK_BLOCK_SIZE / 8)
+#define BITS_PER_BLOCK         (DISK_BLOCK_SIZE * 8)
+
+// Journal size: one block per JOURNAL_RATIO blocks of disk, within limits,
+// but never more than 1/JOURNAL_SHARE of the disk or than it takes to log
+// every metadata block at once. A journal that can't take a transaction
+// of JOURNAL_MIN_TXN blocks isn't worth having.
+#define JOURNAL_RATIO      256
+#define JOURNAL_SHARE      8
+#define JOURNAL_MIN_TXN    16
+#define JOURNAL_MIN_BLOCKS 64
+#define JOURNAL_MAX_BLOCKS 8192
+
+// Blocks per read request when loading the inode table and inline region
+#define MOUNT_BATCH_BLOCKS 8
+
+// Runs fs_read can have in flight before it stops to check them
+#define READ_CHECK_RUNS 64
+
 #define DIVIDE(a, b) (a % b ? a / b + 1 : a / b)
-#define INODE_NUMBER(blockno, index) (INODES_PER_BLOCK * (blockno-1) + index)
 
 int BEEN_MOUNTED = 0;
-char *G_FREE_BLOCK_BITMAP;
+struct bitmap G_FREE_BLOCK_BITMAP;
 
 struct fs_superblock {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int version;            // on-disk format, FS_VERSION_*
+    int bitmapstart;        // first block of the persistent free map
+    int nbitmapblocks;      // length of the free map
+    int clean;              // set when the free map on disk is up to date
+    int journalstart;       // first block of the journal
+    int njournalblocks;     // length of the journal
+    unsigned journalseq;    // last transaction committed before unmount
+    int csumstart;          // first block of the checksum table
+    int ncsumblocks;        // length of the checksum table
+    int compression;        // FS_COMPRESS_* for file data
+    int dedupstart;         // first block of the dedup table
+    int ndedupblocks;       // length of the dedup table, 0 if blocks aren't shared
+    int inlinestart;        // first block of the inline data region
+    int ninlineblocks;      // length of the inline data region, 0 if there is none
 };
 
+// The inode as it is held in memory, and on disk from version 2 on
 struct fs_inode {
+    int isvalid;
+    int flags;              // FS_INODE_*
+    int64_t size;
+    int direct[POINTERS_PER_INODE];
+    int indirect;
+    int dindirect;          // double-indirect block
+    int tindirect;          // triple-indirect block
+    int inlineslot;         // where an inline file's data is, from version 7
+    int reserved[3];
+};
+
+// The inode of version 0 and 1 images
+struct fs_inode_v1 {
     int isvalid;
     int size;
     int direct[POINTERS_PER_INODE];
     int indirect;
 };
 
+#define INODES_PER_BLOCK    (DISK_BLOCK_SIZE / sizeof(struct fs_inode))
+#define INODES_PER_BLOCK_V1 (DISK_BLOCK_SIZE / sizeof(struct fs_inode_v1))
+
 union fs_block {
     struct fs_superblock super;
     struct fs_inode inode[INODES_PER_BLOCK];
+    struct fs_inode_v1 inode_v1[INODES_PER_BLOCK_V1];
     int pointers[POINTERS_PER_BLOCK];
     char data[DISK_BLOCK_SIZE];
 };
 
-struct fs_superblock SUPER = {0x00000000, 0, 0, 0};
-int next_free_block();
+struct fs_superblock SUPER = {0x00000000, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Every fs_* call holds FS_LOCK shared; format, mount and unmount hold
+// it exclusively. Inodes hash onto a fixed set of reader/writer locks,
+// so readers of one file share it and writers of different files
+// rarely meet. INODE_MAP_LOCK guards the free inode index and SYNC_LOCK
+// keeps two threads from writing the same metadata back at once.
+#define INODE_LOCK_STRIPES 1024
+pthread_rwlock_t FS_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t INODE_LOCKS[INODE_LOCK_STRIPES];
+pthread_once_t INODE_LOCKS_ONCE = PTHREAD_ONCE_INIT;
+pthread_mutex_t INODE_MAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t SYNC_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// The free map is split into word-aligned shards, each with its own
+// lock and next-fit cursor. Allocations start in a shard picked by
+// inode number and move on to the others only when it is full.
+#define MAX_ALLOC_SHARDS    16
+#define MIN_ALLOC_SHARD_BITS 4096
+struct alloc_shard {
+    pthread_mutex_t lock;
+    int lo;                 // first block (inclusive)
+    int hi;                 // last block (exclusive)
+    int cursor;             // next-fit position
+};
+struct alloc_shard ALLOC_SHARDS[MAX_ALLOC_SHARDS];
+int NALLOC_SHARDS = 0;
+
+// Resident copy of every inode, loaded by fs_mount and widened to the
+// current layout. Inode changes are made here and their block marked
+// dirty; fs_sync writes the dirty blocks back in the image's layout.
+struct fs_inode *INODE_TABLE;
+char *INODE_DIRTY;
+
+// Inline data region, indexed by inline slot. The slots in use are
+// marked in INLINE_MAP, and region blocks changed in INLINE_DIRTY.
+char (*INLINE_TABLE)[FS_INLINE_MAX];
+struct bitmap INLINE_MAP;
+char *INLINE_DIRTY;
+
+// Blocks being freed by fs_delete, gathered into runs
+struct free_run {
+    int start;
+    int count;
+};
+
+// Start of the data of a compressed cluster: the length of what
+// lz_compress produced, and which of its logical blocks held anything
+// before it was packed, so holes stay holes
+struct cluster_header {
+    uint32_t length;
+    uint32_t mask;
+};
+
+// A run of blocks fs_read fetched straight into the caller's buffer,
+// to be checked against their checksums once it lands
+struct read_run {
+    int blocknum;
+    int count;
+    char *data;
+};
+
+// Extents reserved up front by fs_write. next_free_block hands these
+// out in order before falling back to the bitmap.
+#define MAX_RESERVED_EXTENTS 8
+struct fs_extent {
+    int start;
+    int length;
+};
+
+// The block-mapping state of one inode for the length of a call.
+// Pointer blocks go through the pointer cache, which holds on to any
+// changes until mapping_commit writes each block back once. Blocks are
+// allocated from the call's own reserved extents first, then from the
+// inode's home shard.
+struct fs_mapping {
+    int inumber;
+    struct fs_inode *inode;
+    struct fs_extent reserved[MAX_RESERVED_EXTENTS];
+    int nreserved;
+    int promised;   // flushing the page buffer, so it may use the blocks held for it
+};
+
+// Index of inodes in use, so fs_create doesn't have to scan the table.
+// Inode 0 is never handed out.
+struct bitmap INODE_MAP;
+
+// A pointer block waiting to be scanned at mount, and how many levels
+// of pointer blocks sit below it
+struct mount_ptr {
+    int blocknum;
+    int depth;
+};
+
+// One mount worker's share of the inode table
+struct mount_shard {
+    int first;              // first inode (inclusive)
+    int last;               // last inode (inclusive)
+    int batch_size;         // pointer blocks read per round
+    int pending;            // reads still in flight
+    int scanned;            // pointer blocks read
+    int started;            // set if running on its own thread
+    struct mount_ptr *todo; // pointer blocks found but not yet read
+    int ntodo;
+    int maxtodo;
+    pthread_t thread;
+    struct bitmap map;      // blocks found in use
+};
+int MOUNT_THREADS = 4;
+
+int ALLOC_MODE = FS_ALLOC_EXTENT;
+
+// Whether writes smaller than DELALLOC_WRITE_MAX are held in the page
+// buffer and only given blocks when it is flushed. Bigger writes are
+// laid out well enough on their own.
+int DELALLOC = 1;
+#define DELALLOC_WRITE_MAX (256 * DISK_BLOCK_SIZE)
+
+// What fs_format records for new images to compress file data with,
+// and whether they share identical blocks
+int COMPRESSION = FS_COMPRESS_NONE;
+int DEDUP = 0;
+
+// Whether progress messages (INFO:) are printed
+int VERBOSE = 1;
+
+static const union fs_block *block_view( int blocknum, union fs_block *buf );
+static int  block_read( int blocknum, char *data );
+static void block_write( int blocknum, const char *data );
+static int  read_check( struct read_run *runs, int nruns, const char *base, int limit );
+static int  data_start();
+static int  inode_map_build();
+static void super_write();
+static void freemap_load();
+static void freemap_flush( void (*write)( int blocknum, const char *data ) );
+static void metadata_flush( void (*write)( int blocknum, const char *data ) );
+static void metadata_log();
+static struct fs_inode *inode_lookup( int inumber );
+static void inode_dirty( int inumber );
+static int  mount_locked();
+static void unmount_locked();
+static void info( const char *format, ... );
+static int  fs_enter( const char *op );
+static void fs_leave();
+static pthread_rwlock_t *inode_lock( int inumber );
+static void sync_locked();
+static void txn_begin( int credits );
+static void txn_end();
+static int  write_credits( int length );
+static int  delete_locked( int inumber );
+static int  read_locked( int inumber, char *data, int length, int64_t offset );
+static int  write_locked( int inumber, const char *data, int length, int64_t offset );
+static int  delayed_write( int inumber, const char *data, int length, int64_t offset );
+static void delayed_flush( int inumber );
+static void delayed_flush_all();
+static int64_t file_size( int inumber, struct fs_inode *inode );
+static int  punch_locked( int inumber, int64_t offset, int64_t length );
+static void punch_partial( struct fs_mapping *map, int64_t start, int64_t end );
+static void unmap_range( struct fs_mapping *map, int first, int last );
+static int  unmap_tree( struct fs_mapping *map, struct free_run *run, int blocknum, int depth, int first, int last );
+static int  compressed_write( struct fs_mapping *map, const char *data, int length, int64_t offset );
+static void compressed_flush( struct fs_mapping *map, const int *lblocks, const char *pages, int n );
+static void compressed_punch( struct fs_mapping *map, int64_t start, int64_t end );
+static void punch_cluster( struct fs_mapping *map, int64_t start, int64_t end );
+static int  dedup_write( struct fs_mapping *map, const char *data, int length, int64_t offset );
+static int  dedup_store( struct fs_mapping *map, int lblock, const char *data );
+static int  block_same( int blocknum, const char *data );
+static void io_done( void *arg, int blocknum, int count );
+static void io_wait( int *pending );
+static void alloc_shards_init();
+static struct alloc_shard *alloc_shard_of( int blocknum );
+static int  next_free_block( struct fs_mapping *map );
+static int  blocks_spare( struct fs_mapping *map );
+static int  blocks_promised( int unmapped );
+static void free_blocks( int start, int count );
+static void reserve_extents( struct fs_mapping *map, int first, int last );
+static void reserve_blocks( struct fs_mapping *map, int first, int needed );
+static int  inodes_per_block( int version );
+static void inodes_decode( int version, const union fs_block *block, struct fs_inode *inodes );
+static void inodes_encode( int version, const struct fs_inode *inodes, union fs_block *block );
+static int  inline_write( int inumber, struct fs_inode *inode, const char *data, int length, int64_t offset );
+static int  inline_spill( struct fs_mapping *map );
+static char *inline_data( int inumber );
+static void inline_dirty( int inumber );
+static void inline_release( int inumber );
+static int  inline_load();
+static void *mount_worker( void *arg );
+static void mount_push( struct mount_shard *shard, int blocknum, int depth );
+static void mount_scan_batch( struct mount_shard *shard, union fs_block *buf );
+static void release_extents( struct fs_mapping *map );
+static void mapping_init( struct fs_mapping *map, int inumber, struct fs_inode *inode );
+static void mapping_commit( struct fs_mapping *map );
+static int  max_file_blocks();
+static int  level_span( int level );
+static int *tree_root( struct fs_inode *inode, int *lblock, int *depth );
+static int  block_map( struct fs_mapping *map, int lblock, int allocate, int *fresh );
+static int  block_path_missing( struct fs_mapping *map, int lblock );
+static int  block_set( struct fs_mapping *map, int lblock, int value );
+static int  lblock_read( struct fs_mapping *map, int lblock, char *data );
+static int  cluster_compressed( struct fs_mapping *map, int lblock );
+static int  cluster_load( struct fs_mapping *map, int cluster, char *data, int *mask );
+static int  cluster_store( struct fs_mapping *map, int cluster, const char *data, int mask, int dirty );
+static void cluster_unmap( struct fs_mapping *map, int cluster );
+static void tree_walk( int blocknum, int depth, void (*visit)( void *arg, int blocknum, int depth ), void *arg );
+static void free_visit( void *arg, int blocknum, int depth );
+static int  metadata_rebuild();
+static void rebuild_visit( void *arg, int blocknum, int depth );
 
 int fs_format()
 {
     //check if disk is already mounted
+    pthread_rwlock_wrlock(&FS_LOCK);
     if(BEEN_MOUNTED){
         printf("Cannot format a disk that is already mounted\n");
+        pthread_rwlock_unlock(&FS_LOCK);
         return 0;
     }
-    //set aside 10% of blocks for inodes
+    //set aside 10% of blocks for inodes, then enough for the free map
     int nblocks = disk_size();
     int ninodeblocks = DIVIDE(nblocks, 10);
     int ninodes = ninodeblocks * INODES_PER_BLOCK;
     //set appropriate superblock SUPER values
+    memset(&SUPER, 0, sizeof(SUPER));
     SUPER.magic = FS_MAGIC;
     SUPER.nblocks = nblocks;
     SUPER.ninodeblocks = ninodeblocks;
     SUPER.ninodes = ninodes;
-    //destroy any data already present by setting all the inode isvalid bits to 0
-    int i;
-    for(i = 1; i < SUPER.ninodeblocks + 1; i++){
-        //read an inode block
-        union fs_block inode_block;
-        disk_read(i, inode_block.data);
-        int j;
-        for(j = 0; j < INODES_PER_BLOCK; j++){
-            //set all the inodes in that block to invalid
-            inode_block.inode[j].isvalid = 0;
-        }
-        //write block back to disk
-        disk_write(i, inode_block.data);
+    SUPER.version = FS_VERSION;
+    SUPER.inlinestart = ninodeblocks + 1;
+    int inline_share = INLINE_INODES * INLINE_PER_BLOCK;
+    SUPER.ninlineblocks = DIVIDE(ninodes, inline_share);
+    if(SUPER.ninlineblocks > DIVIDE(nblocks, INLINE_RATIO)) SUPER.ninlineblocks = DIVIDE(nblocks, INLINE_RATIO);
+    if(SUPER.ninlineblocks > INLINE_MAX_BLOCKS) SUPER.ninlineblocks = INLINE_MAX_BLOCKS;
+    SUPER.bitmapstart = SUPER.inlinestart + SUPER.ninlineblocks;
+    SUPER.nbitmapblocks = DIVIDE(nblocks, BITS_PER_BLOCK);
+    SUPER.clean = 1;
+    SUPER.ncsumblocks = DIVIDE(nblocks, CSUMS_PER_BLOCK);
+    SUPER.ndedupblocks = DEDUP ? DIVIDE(nblocks, DEDUP_PER_BLOCK) : 0;
+    SUPER.compression = COMPRESSION;
+    //size the journal, going without one if the disk is too small to
+    //hold it and still have room for data, and then without inline data
+    int metadata = 1 + ninodeblocks + SUPER.ninlineblocks + SUPER.nbitmapblocks
+                   + SUPER.ncsumblocks + SUPER.ndedupblocks;
+    SUPER.njournalblocks = nblocks / JOURNAL_RATIO;
+    if(SUPER.njournalblocks < JOURNAL_MIN_BLOCKS) SUPER.njournalblocks = JOURNAL_MIN_BLOCKS;
+    if(SUPER.njournalblocks > JOURNAL_MAX_BLOCKS) SUPER.njournalblocks = JOURNAL_MAX_BLOCKS;
+    if(SUPER.njournalblocks > nblocks / JOURNAL_SHARE) SUPER.njournalblocks = nblocks / JOURNAL_SHARE;
+    if(SUPER.njournalblocks > journal_size(metadata)) SUPER.njournalblocks = journal_size(metadata);
+    if(SUPER.njournalblocks < journal_size(JOURNAL_MIN_TXN) || metadata + SUPER.njournalblocks >= nblocks)
+        SUPER.njournalblocks = 0;
+    if(metadata >= nblocks){
+        SUPER.bitmapstart -= SUPER.ninlineblocks;
+        SUPER.ninlineblocks = 0;
+    }
+    SUPER.journalstart = SUPER.bitmapstart + SUPER.nbitmapblocks;
+    SUPER.csumstart = SUPER.journalstart + SUPER.njournalblocks;
+    SUPER.dedupstart = SUPER.csumstart + SUPER.ncsumblocks;
+    if(DEDUP && COMPRESSION != FS_COMPRESS_NONE){
+        printf("Compressed images can't share blocks\n");
+        pthread_rwlock_unlock(&FS_LOCK);
+        return 0;
     }
+    if(data_start() >= nblocks){
+        printf("Disk is too small to format\n");
+        pthread_rwlock_unlock(&FS_LOCK);
+        return 0;
+    }
+    super_write();
+    //destroy any data already present by writing out empty inode blocks
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    for(int i = 1; i < SUPER.ninodeblocks + 1; i++)
+        disk_write(i, block.data);
+    //and an empty journal, so there is nothing to replay
+    if(SUPER.njournalblocks) disk_write(SUPER.journalstart, block.data);
+    //no block has a checksum yet, or is shared
+    for(int i = 0; i < SUPER.ncsumblocks; i++)
+        disk_write(SUPER.csumstart + i, block.data);
+    for(int i = 0; i < SUPER.ndedupblocks; i++)
+        disk_write(SUPER.dedupstart + i, block.data);
+    //write a free map with only the metadata blocks in use
+    ptrcache_reset();
+    bitmap_destroy(&G_FREE_BLOCK_BITMAP);
+    if(!bitmap_init(&G_FREE_BLOCK_BITMAP, nblocks)
+       || !bitmap_track(&G_FREE_BLOCK_BITMAP, BITMAP_WORDS_PER_BLOCK)){
+        printf("Couldn't allocate free block bitmap\n");
+        pthread_rwlock_unlock(&FS_LOCK);
+        return 0;
+    }
+    bitmap_set_range(&G_FREE_BLOCK_BITMAP, 0, data_start());
+    bitmap_dirty_all(&G_FREE_BLOCK_BITMAP);
+    freemap_flush(disk_write);
+    disk_sync();
+    pthread_rwlock_unlock(&FS_LOCK);
     return 1;
 }
 
 void fs_debug(){
 
+    // Get everything written so far to its home location first
+    pthread_rwlock_rdlock(&FS_LOCK);
+    if(BEEN_MOUNTED){
+        delayed_flush_all();
+        journal_commit();
+    }
+    pthread_rwlock_unlock(&FS_LOCK);
+
     // Process the super block
     union fs_block block;
     disk_read(0, block.data);
@@ -88,43 +467,81 @@ void fs_debug(){
     printf("    %d blocks\n",block.super.nblocks);
     printf("    %d inode blocks\n",block.super.ninodeblocks);
     printf("    %d inodes\n",block.super.ninodes);
+    if(block.super.version >= FS_VERSION_INLINE && block.super.ninlineblocks){
+        printf("    inline data at block %d (%d blocks), %d slots in use\n", block.super.inlinestart,
+               block.super.ninlineblocks, INLINE_TABLE ? INLINE_MAP.nbits - INLINE_MAP.nfree : 0);
+    }
+    if(block.super.version >= FS_VERSION_FREEMAP){
+        printf("    free map at block %d (%d blocks), %s\n", block.super.bitmapstart,
+               block.super.nbitmapblocks, block.super.clean ? "clean" : "dirty");
+    }
+    if(block.super.version >= FS_VERSION_JOURNAL && !block.super.njournalblocks){
+        printf("    no journal, free map rebuilt after a crash\n");
+    } else if(block.super.version >= FS_VERSION_JOURNAL){
+        printf("    journal at block %d (%d blocks), last transaction %u\n", block.super.journalstart,
+               block.super.njournalblocks, block.super.journalseq);
+    }
+    if(block.super.version >= FS_VERSION_CHECKSUM){
+        printf("    checksums at block %d (%d blocks), %s, %lld mismatches\n", block.super.csumstart,
+               block.super.ncsumblocks, csum_verifying() ? "verified" : "not verified", csum_errors());
+    }
+    if(block.super.version >= FS_VERSION_COMPRESS && block.super.compression == FS_COMPRESS_LZ)
+        printf("    file data compressed in clusters of %d blocks\n", CLUSTER_BLOCKS);
+    if(block.super.version >= FS_VERSION_DEDUP && block.super.ndedupblocks){
+        long long shared = 0, saved = 0;
+        if(dedup_active()) dedup_summary(&shared, &saved);
+        printf("    dedup table at block %d (%d blocks), %lld blocks shared, %lld saved\n",
+               block.super.dedupstart, block.super.ndedupblocks, shared, saved);
+    }
 
     // For each inode block (this excludes the super block
     // at index 0)...
+    int per_block = inodes_per_block(block.super.version);
     for(int i = 1; i <= block.super.ninodeblocks; i++){
 
-        // Read the block from disk to the block struct
-        union fs_block direct_block;
-        disk_read(i, direct_block.data);
+        // Read the block from disk and widen its inodes
+        union fs_block inode_block;
+        struct fs_inode inodes[INODES_PER_BLOCK_V1];
+        disk_read(i, inode_block.data);
+        inodes_decode(block.super.version, &inode_block, inodes);
 
         // For each inode in the block we just read...
-        for(int j = 0; j < INODES_PER_BLOCK; j++){
+        for(int j = 0; j < per_block; j++){
 
             // Skip invalid inodes, we only care about the ones
             // that refer to actual files
-            if(!direct_block.inode[j].isvalid) continue;
+            struct fs_inode *inode = &inodes[j];
+            if(!inode->isvalid) continue;
 
             // Regular inode debugging output
-            printf("inode %d:\n", INODE_NUMBER(i, j));
-            printf("    size: %d bytes\n", direct_block.inode[j].size);
+            printf("inode %d:\n", per_block * (i - 1) + j);
+            printf("    size: %lld bytes\n", (long long)inode->size);
+            if(inode->flags & FS_INODE_INLINE){
+                printf("    inline data\n");
+                continue;
+            }
             printf("    direct blocks: ");
 
             // Report each direct block pointer (the list is null terminated and
             // does not exceed POINTERS_PER_INODE in length)
             for(int k = 0; k < POINTERS_PER_INODE; k++)
-                if(direct_block.inode[j].direct[k]) printf("%d ", direct_block.inode[j].direct[k]);
+                if(inode->direct[k] > 0) printf("%d ", inode->direct[k]);
             printf("\n");
 
+            // Deeper pointer trees are only reported by their root
+            if(inode->dindirect) printf("    double indirect block: %d\n", inode->dindirect);
+            if(inode->tindirect) printf("    triple indirect block: %d\n", inode->tindirect);
+
             // If the inode has an indirect pointer, process the target indoe
-            if(!direct_block.inode[j].indirect) continue;
+            if(!inode->indirect) continue;
 
             // Report the indirect block info located within the inode
-            printf("    indirect block: %d\n", direct_block.inode[j].indirect);
+            printf("    indirect block: %d\n", inode->indirect);
             printf("    indirect data blocks: ");
 
             // Read in the indrect block and process it
             union fs_block indirect_block;
-            disk_read(direct_block.inode[j].indirect, indirect_block.data);
+            disk_read(inode->indirect, indirect_block.data);
 
             // Report the direct pointers in the inode
             for(int m = 0; m < POINTERS_PER_BLOCK; m++)
@@ -138,7 +555,25 @@ void fs_debug(){
 
 int fs_mount(){
 
-    BEEN_MOUNTED = 1;
+    // Nothing else may run while the resident tables are replaced
+    struct stats_call call;
+    stats_begin(&call);
+    pthread_rwlock_wrlock(&FS_LOCK);
+    int ok = mount_locked();
+    pthread_rwlock_unlock(&FS_LOCK);
+    stats_end(&call, FS_OP_MOUNT, ok);
+    return ok;
+}
+
+static int mount_locked(){
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // Mounting over a mounted disk finishes that mount first, so writes
+    // still held in the page buffer reach the disk instead of being
+    // dropped with it
+    if(BEEN_MOUNTED) unmount_locked();
 
     // Get info from super block
     union fs_block superblock;
@@ -146,110 +581,373 @@ int fs_mount(){
 
     // Check magic value to verify validitiy
     if(superblock.super.magic != FS_MAGIC){
-        printf("ERROR: Invalid magic value 0x%x", superblock.super.magic);
+        printf("ERROR: Invalid magic value 0x%x\n", superblock.super.magic);
+        return 0;
+    }
+    if(superblock.super.version > FS_VERSION){
+        printf("ERROR: Unsupported format version %d\n", superblock.super.version);
         return 0;
     }
 
-    // Initialize and build free block bitmap
-    G_FREE_BLOCK_BITMAP = malloc(8 * superblock.super.nblocks);
+    // Keep the super block and inode table resident while mounted
+    SUPER = superblock.super;
+    if(SUPER.version < FS_VERSION_COMPRESS) SUPER.compression = FS_COMPRESS_NONE;
+    if(SUPER.version < FS_VERSION_DEDUP) SUPER.dedupstart = SUPER.ndedupblocks = 0;
+    if(SUPER.version < FS_VERSION_INLINE) SUPER.inlinestart = SUPER.ninlineblocks = 0;
+    if(SUPER.compression != FS_COMPRESS_NONE && SUPER.compression != FS_COMPRESS_LZ){
+        printf("ERROR: Unsupported compression %d\n", SUPER.compression);
+        return 0;
+    }
 
-    // For each inode block...
-    for(int i = 1; i <= superblock.super.ninodeblocks; i++){
+    // A journal still running from an earlier mount is finished first
+    if(journal_active()) journal_close();
+    csum_unload();
+    dedup_unload();
+
+    // Finish whatever the journal committed before the last crash, so
+    // the inode table and free map read below are consistent
+    unsigned seq = SUPER.journalseq;
+    if(SUPER.version >= FS_VERSION_JOURNAL && SUPER.njournalblocks){
+        unsigned replayed_seq;
+        int replayed = journal_replay(SUPER.journalstart, SUPER.njournalblocks, &replayed_seq);
+        if(replayed > 0) info("Replayed %d blocks from journal transaction %u\n", replayed, replayed_seq);
+        if(replayed_seq > seq) seq = replayed_seq;
+    }
+    free(INODE_TABLE);
+    free(INODE_DIRTY);
+    free(INLINE_TABLE);
+    free(INLINE_DIRTY);
+    INLINE_TABLE = 0;
+    INLINE_DIRTY = 0;
+    union fs_block *raw = malloc(sizeof(union fs_block) * SUPER.ninodeblocks);
+    INODE_TABLE = 0;
+    INODE_DIRTY = calloc(SUPER.ninodeblocks, 1);
+    ptrcache_reset();
+
+    // Initialize and build free block bitmap, with the super block and
+    // every inode block permanently in use
+    bitmap_destroy(&G_FREE_BLOCK_BITMAP);
+    if(!bitmap_init(&G_FREE_BLOCK_BITMAP, SUPER.nblocks)){
+        printf("ERROR: Couldn't allocate free block bitmap\n");
+        return 0;
+    }
+    bitmap_set_range(&G_FREE_BLOCK_BITMAP, 0, data_start());
+    if(SUPER.version >= FS_VERSION_FREEMAP)
+        bitmap_track(&G_FREE_BLOCK_BITMAP, BITMAP_WORDS_PER_BLOCK);
+
+    // Read the whole inode table, keeping many requests in flight
+    for(int i = 0; i < SUPER.ninodeblocks; i += MOUNT_BATCH_BLOCKS){
+        int count = SUPER.ninodeblocks - i;
+        if(count > MOUNT_BATCH_BLOCKS) count = MOUNT_BATCH_BLOCKS;
+        disk_submit_read(i + 1, count, raw[i].data, 0, 0);
+    }
+    disk_drain();
+
+    // Images from version 2 on hold inodes in exactly the resident
+    // layout; older ones are unpacked a block at a time
+    if(SUPER.version >= FS_VERSION_WIDE){
+        INODE_TABLE = (struct fs_inode *)raw;
+    } else {
+        int per_block = inodes_per_block(SUPER.version);
+        INODE_TABLE = malloc(sizeof(struct fs_inode) * SUPER.ninodes);
+        for(int i = 0; i < SUPER.ninodeblocks; i++)
+            inodes_decode(SUPER.version, &raw[i], INODE_TABLE + (size_t)i * per_block);
+        free(raw);
+    }
 
-        // Read in the inode block
-        union fs_block block;
-        disk_read(i, block.data);
+    // Index the free inodes so create never has to search the table
+    if(!inode_map_build()){
+        printf("ERROR: Couldn't allocate free inode index\n");
+        return 0;
+    }
+    if(SUPER.ninlineblocks && !inline_load()){
+        printf("ERROR: Couldn't allocate the inline data region\n");
+        return 0;
+    }
+    if(!pagebuf_init(SUPER.ninodes)){
+        printf("ERROR: Couldn't allocate the page buffer\n");
+        return 0;
+    }
 
-        // Mark all inode blocks as used
-        G_FREE_BLOCK_BITMAP[i] = 1;
+    // After a clean unmount the free map on disk can be trusted, so there
+    // is no need to go looking through every file. With a journal it
+    // always can be, once the journal has been replayed. An image too
+    // small for one writes its metadata through the block cache in no
+    // particular order, so after a crash it is rebuilt below.
+    if((SUPER.version >= FS_VERSION_FREEMAP && SUPER.clean)
+       || (SUPER.version >= FS_VERSION_JOURNAL && SUPER.njournalblocks)){
+        freemap_load();
+        if(SUPER.version >= FS_VERSION_CHECKSUM
+           && !csum_load(SUPER.csumstart, SUPER.ncsumblocks, SUPER.nblocks)){
+            printf("ERROR: Couldn't allocate the checksum table\n");
+            return 0;
+        }
+        if(SUPER.ndedupblocks && !dedup_load(SUPER.dedupstart, SUPER.ndedupblocks, SUPER.nblocks)){
+            printf("ERROR: Couldn't allocate the dedup table\n");
+            return 0;
+        }
+        SUPER.clean = 0;
+        super_write();
+        disk_sync();
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+        info("Mount loaded the free map from disk in %.3f ms\n", seconds * 1e3);
+        alloc_shards_init();
+        // Without its journal the image could not be trusted after a crash
+        if(SUPER.version >= FS_VERSION_JOURNAL && SUPER.njournalblocks
+           && !journal_open(SUPER.journalstart, SUPER.njournalblocks, seq, metadata_log)){
+            printf("ERROR: Couldn't start the journal\n");
+            return 0;
+        }
+        BEEN_MOUNTED = 1;
+        return 1;
+    }
 
-        // For each inode in the block we just read...
-        for(int j = 0; j < INODES_PER_BLOCK; j++){
+    // Shard the inode table across worker threads. Each builds its own
+    // map of used blocks, and the maps are ORed together at the end.
+    int nthreads = MOUNT_THREADS;
+    if(nthreads > SUPER.ninodeblocks) nthreads = SUPER.ninodeblocks;
+    if(nthreads < 1) nthreads = 1;
+    struct mount_shard *shards = calloc(nthreads, sizeof(struct mount_shard));
+    int per_shard = DIVIDE(SUPER.ninodes, nthreads);
+    int ok = shards != 0;
+
+    for(int t = 0; ok && t < nthreads; t++){
+        shards[t].first = t * per_shard;
+        shards[t].last  = shards[t].first + per_shard - 1;
+        if(shards[t].last >= SUPER.ninodes) shards[t].last = SUPER.ninodes - 1;
+        shards[t].batch_size = DISK_QUEUE_DEPTH / nthreads;
+        if(shards[t].batch_size < 1) shards[t].batch_size = 1;
+        if(!bitmap_init(&shards[t].map, SUPER.nblocks)){
+            ok = 0;
+            break;
+        }
+        // The first shard runs on this thread
+        if(t > 0 && pthread_create(&shards[t].thread, 0, mount_worker, &shards[t])){
+            ok = 0;
+            break;
+        }
+        shards[t].started = t > 0;
+    }
+    if(ok) mount_worker(&shards[0]);
+
+    int scanned = SUPER.ninodeblocks;
+    for(int t = 0; shards && t < nthreads; t++){
+        if(shards[t].started) pthread_join(shards[t].thread, 0);
+        if(ok) bitmap_merge(&G_FREE_BLOCK_BITMAP, &shards[t].map);
+        scanned += shards[t].scanned;
+        bitmap_destroy(&shards[t].map);
+        free(shards[t].todo);
+    }
+    free(shards);
+    if(!ok){
+        printf("ERROR: Couldn't start mount workers\n");
+        return 0;
+    }
 
-            // Skip empty inodes
-            if(!block.inode[j].isvalid) continue;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    info("Mount scanned %d blocks with %d threads in %.3f ms (%.0f blocks/s)\n",
+           scanned, nthreads, seconds * 1e3, seconds > 0 ? scanned / seconds : 0);
 
-            // Mark each used block as such in the bitmap
-            for(int k = 0; k < POINTERS_PER_INODE && block.inode[j].direct[k]; k++)
-                G_FREE_BLOCK_BITMAP[block.inode[j].direct[k]] = 1;
+    // So were the checksum and dedup tables
+    if(SUPER.version >= FS_VERSION_CHECKSUM && !metadata_rebuild()){
+        printf("ERROR: Couldn't rebuild the checksum and dedup tables\n");
+        return 0;
+    }
 
-            // Record any blocks in use via indirection (else continue)
-            if(!block.inode[j].indirect) continue;
+    // The map on disk was stale; replace it with the one we just built
+    if(SUPER.version >= FS_VERSION_FREEMAP){
+        bitmap_dirty_all(&G_FREE_BLOCK_BITMAP);
+        sync_locked();
+        SUPER.clean = 0;
+        super_write();
+        disk_sync();
+    }
 
-            // Mark the block of indirect pointers as used
-            G_FREE_BLOCK_BITMAP[block.inode[j].indirect] = 1;
+    alloc_shards_init();
+    BEEN_MOUNTED = 1;
 
-            union fs_block indirect_block;
-            disk_read(block.inode[j].indirect, indirect_block.data);
+    // Return 1 (success code; failure is 0)
+    return 1;
+}
 
-            // Update bitmap with indirectly referenced blocks
-            for(int k = 0; k < POINTERS_PER_BLOCK; k++)
-                if(indirect_block.pointers[k])
-                    G_FREE_BLOCK_BITMAP[indirect_block.pointers[k]] = 1;
+void fs_sync(){
 
-        }
+    pthread_rwlock_rdlock(&FS_LOCK);
+    if(BEEN_MOUNTED) delayed_flush_all();
+    if(BEEN_MOUNTED && journal_active()) journal_commit();
+    else if(BEEN_MOUNTED){
+        sync_locked();
+        disk_sync();
     }
+    pthread_rwlock_unlock(&FS_LOCK);
+}
 
-    // Return 1 (success code; failure is 0)
-    return 1;
+static void sync_locked(){
+    metadata_flush(disk_write);
 }
 
-int fs_create(){
-    if(!BEEN_MOUNTED){
-        printf("Disk needs to be mounted before you can create\n");
-        return 0;
+static void metadata_flush( void (*write)( int blocknum, const char *data ) ){
+
+    // Write back every inode block touched since the last sync. The flag
+    // is cleared before the copy is taken, so a change racing with us
+    // leaves the block dirty for the next sync rather than being lost.
+    pthread_mutex_lock(&SYNC_LOCK);
+    for(int i = 0; i < SUPER.ninodeblocks; i++){
+        if(!__atomic_exchange_n(&INODE_DIRTY[i], 0, __ATOMIC_ACQ_REL)) continue;
+        union fs_block block;
+        size_t first = (size_t)i * inodes_per_block(SUPER.version);
+        inodes_encode(SUPER.version, INODE_TABLE + first, &block);
+        write(i + 1, block.data);
     }
-    // The objective here is to find an open (invalid) inode, initialize
-    // it for use, and then return its inumber
 
-    union fs_block superblock;
-    disk_read(0, superblock.data);
+    // Then the inline data region blocks
+    for(int i = 0; i < SUPER.ninlineblocks; i++){
+        if(!__atomic_exchange_n(&INLINE_DIRTY[i], 0, __ATOMIC_ACQ_REL)) continue;
+        union fs_block block;
+        memset(block.data, 0, sizeof(block.data));
+        memcpy(block.data, INLINE_TABLE + (size_t)i * INLINE_PER_BLOCK, INLINE_PER_BLOCK * FS_INLINE_MAX);
+        write(SUPER.inlinestart + i, block.data);
+    }
 
-    // For each inode block...
-    int i;
-    for(i = 1; i <= superblock.super.ninodeblocks; i++){
+    // Along with any part of the free map, checksum table or dedup
+    // table that changed
+    freemap_flush(write);
+    csum_flush(write);
+    dedup_flush(write);
+    pthread_mutex_unlock(&SYNC_LOCK);
+}
 
-        union fs_block block;
-        disk_read(i, block.data);
+static void metadata_log(){
 
-        // For each inode in the block...
-        int j;
-        for(j = 0; j < INODES_PER_BLOCK; j++){
+    // Journal snapshot: no operation is in progress, so the resident
+    // inode table and free map are consistent with each other
+    metadata_flush(journal_write);
+}
 
-            // Skip VALID inodes
-            if(block.inode[j].isvalid || !INODE_NUMBER(i, j)) continue;
-            printf("INFO: Found ivalid invode (%d, %d)=%d\n", i, j, INODE_NUMBER(i, j));
+static void txn_begin( int credits ){
 
-            // Initialize the found inode
-            block.inode[j].isvalid  = 1;
-            block.inode[j].size     = 0;
-            block.inode[j].indirect = 0;
-            int k;
-            for(k = 0; k < POINTERS_PER_INODE; k++)
-                block.inode[j].direct[k] = 0;
+    // Bracket one operation's metadata changes. Taken after the inode
+    // lock, never before, since a commit waits for every open operation.
+    journal_begin(credits);
+}
 
-            // Write the changes to disk
-            disk_write(i, block.data);
+static void txn_end(){
 
-            // Calculate and return the inumber
-            return INODE_NUMBER(i, j);
-        }
+    // Without a journal the changes go straight home, as they always did
+    if(journal_active()) journal_end();
+    else sync_locked();
+}
+
+static int write_credits( int length ){
+
+    // Journal blocks a write of length bytes can dirty: its inode block,
+    // a pointer block per 1024 data blocks plus the paths down to them,
+    // the free map chunks its extents come from (anywhere at all when
+    // rewritten clusters or shared blocks give their old blocks back),
+    // the checksum table blocks covering the data and pointer blocks (one
+    // apiece, when sharing scatters them), and the dedup entries of each
+    // block written, shared or let go of
+    int n = length / DISK_BLOCK_SIZE + 2;
+    int pointers = n / POINTERS_PER_BLOCK + 6;
+    int bitmap = n / BITS_PER_BLOCK + 2 + MAX_RESERVED_EXTENTS;
+    if(bitmap > SUPER.nbitmapblocks || SUPER.compression || SUPER.ndedupblocks) bitmap = SUPER.nbitmapblocks;
+    int csum = SUPER.version >= FS_VERSION_CHECKSUM ? n / CSUMS_PER_BLOCK + 2 + pointers : 0;
+    if(SUPER.ndedupblocks) csum = n + pointers < SUPER.ncsumblocks ? n + pointers : SUPER.ncsumblocks;
+    int dedup = 2 * n + 2 < SUPER.ndedupblocks ? 2 * n + 2 : SUPER.ndedupblocks;
+    return 1 + pointers + bitmap + csum + dedup;
+}
+
+void fs_unmount(){
+
+    pthread_rwlock_wrlock(&FS_LOCK);
+    if(BEEN_MOUNTED) unmount_locked();
+    pthread_rwlock_unlock(&FS_LOCK);
+}
+
+static void unmount_locked(){
+
+    // Stop background work, then put everything back on disk
+    delayed_flush_all();
+    readahead_shutdown();
+    if(journal_active()) SUPER.journalseq = journal_close();
+    else sync_locked();
+    disk_sync();
+
+    // Everything is on disk: the next mount can trust the free map
+    if(SUPER.version >= FS_VERSION_FREEMAP){
+        SUPER.clean = 1;
+        super_write();
+        disk_sync();
     }
+    BEEN_MOUNTED = 0;
+}
 
-    return 0;
+int fs_create(){
+    int inumber;
+    return fs_create_n(1, &inumber) ? inumber : 0;
+}
+
+int fs_create_n( int count, int *inumbers ){
+    struct stats_call call;
+    stats_begin(&call);
+    if(!fs_enter("create")){
+        stats_end(&call, FS_OP_CREATE, 0);
+        return 0;
+    }
+
+    // Take the lowest free inodes from the index, initialize them, and
+    // write each inode block they live in once at the end
+    int created = 0;
+    while(created < count){
+        pthread_mutex_lock(&INODE_MAP_LOCK);
+        int inumber = bitmap_alloc(&INODE_MAP);
+        pthread_mutex_unlock(&INODE_MAP_LOCK);
+        if(inumber <= 0) break;
+
+        // Initialize the found inode
+        struct fs_inode *inode = &INODE_TABLE[inumber];
+        pthread_rwlock_wrlock(inode_lock(inumber));
+        journal_begin(1);
+        memset(inode, 0, sizeof(struct fs_inode));
+        inode->isvalid = 1;
+        inode_dirty(inumber);
+        journal_end();
+        pthread_rwlock_unlock(inode_lock(inumber));
+
+        inumbers[created++] = inumber;
+    }
+
+    // Write the changes to disk, unless the journal will
+    if(!journal_active()) sync_locked();
+    fs_leave();
+    stats_end(&call, FS_OP_CREATE, created == count);
+    return created;
 }
 
 int fs_delete( int inumber ){
-    if(!BEEN_MOUNTED){
-        printf("Disk needs to be mounted before you can delete\n");
+    struct stats_call call;
+    stats_begin(&call);
+    if(!fs_enter("delete")){
+        stats_end(&call, FS_OP_DELETE, 0);
         return 0;
     }
-    // Grab that super block
-    union fs_block superblock;
-    disk_read(0, superblock.data);
+    pthread_rwlock_t *lock = inode_lock(inumber);
+    pthread_rwlock_wrlock(lock);
+    txn_begin(1 + SUPER.nbitmapblocks + SUPER.ndedupblocks);
+    int ok = delete_locked(inumber);
+    txn_end();
+    pthread_rwlock_unlock(lock);
+    fs_leave();
+    stats_end(&call, FS_OP_DELETE, ok);
+    return ok;
+}
+
+static int delete_locked( int inumber ){
 
     // Check the validity of the inumber
-    if(inumber > superblock.super.ninodes){
+    if(inumber >= SUPER.ninodes || inumber < 0){
         printf("ERROR: Inumber %d is out of range.\n", inumber);
         return 0;
     } else if(inumber == 0){
@@ -257,297 +955,1740 @@ int fs_delete( int inumber ){
         return 0;
     }
 
-    // Calculate target block
-    int blockno = inumber / INODES_PER_BLOCK + 1;
-
-    // Read in the target block
-    union fs_block block;
-    disk_read(blockno, block.data);
-
-    // Index into the block
-    int inode_index = inumber % INODES_PER_BLOCK;
-
     // Verify inode validity (can't delete an invalid inode)
-    if(!block.inode[inode_index].isvalid){
+    struct fs_inode *inode = inode_lookup(inumber);
+    if(!inode){
         printf("ERROR: Cannot delete invalid inode \"%d\"\n", inumber);
         return 0;
     }
 
-    // Update values in free block map, check direct pointers
-    for(int i = 0; i < POINTERS_PER_INODE; i++){
-        int b = block.inode[inode_index].direct[i];
-        if(b > 0){
-            G_FREE_BLOCK_BITMAP[b] = 0;
-            block.inode[inode_index].direct[i] = 0;
-        }
-    }
-
-    // Check indirect pointer
-    union fs_block indirect_block;
-    int indirect_block_num = block.inode[inode_index].indirect;
-
-    // If inode has indirect pointer, update those blocks in bitmap too
-    if(indirect_block_num){
-
-        // Read indirect block
-        disk_read(indirect_block_num, indirect_block.data);
+    readahead_invalidate(inumber);
+    pagebuf_drop(inumber);
 
-        for(int i = 0; i < POINTERS_PER_BLOCK; i++){
-            int b = indirect_block.pointers[i];
-            if(b){
-                G_FREE_BLOCK_BITMAP[b] = 0;
-                indirect_block.pointers[i] = 0;
-            }
-        }
-        disk_write(indirect_block_num, indirect_block.data);
-    }
+    // Update values in free block map, check direct pointers
+    struct free_run run = {0, 0};
+    for(int i = 0; i < POINTERS_PER_INODE; i++)
+        free_visit(&run, inode->direct[i], 0);
+
+    // Then every block reachable through the pointer trees, including
+    // the pointer blocks themselves. Those are zeroed when they are next
+    // allocated, so there is no need to write them back here.
+    if(inode->indirect)  tree_walk(inode->indirect, 1, free_visit, &run);
+    if(inode->dindirect) tree_walk(inode->dindirect, 2, free_visit, &run);
+    if(inode->tindirect) tree_walk(inode->tindirect, 3, free_visit, &run);
+    if(run.count) free_blocks(run.start, run.count);
 
     // Nuke the metadata
-    block.inode[inode_index].isvalid = 0;
-    block.inode[inode_index].size    = 0;
+    if(inode->flags & FS_INODE_INLINE) inline_release(inumber);
+    memset(inode, 0, sizeof(struct fs_inode));
+
+    // The inode is free again; keep the index pointing at the lowest one
+    pthread_mutex_lock(&INODE_MAP_LOCK);
+    bitmap_clear(&INODE_MAP, inumber);
+    bitmap_rewind(&INODE_MAP, inumber);
+    pthread_mutex_unlock(&INODE_MAP_LOCK);
 
     // Save changes to disk
-    disk_write(blockno, block.data);
+    inode_dirty(inumber);
     return 1;
 }
 
-int fs_getsize( int inumber )
+static void count_visit( void *arg, int blocknum, int depth ){
+    (*(int64_t *)arg)++;
+}
+
+int64_t fs_getblocks( int inumber )
 {
-    if(!BEEN_MOUNTED){
-        printf("Disk needs to be mounted before you can getsize\n");
-        return -1;
+    // Disk blocks a file holds, pointer blocks included. Data still in
+    // the page buffer has none yet, and an inline file never does.
+    if(!fs_enter("getblocks")) return -1;
+    pthread_rwlock_rdlock(inode_lock(inumber));
+    struct fs_inode *inode = inode_lookup(inumber);
+    int64_t count = 0;
+    if(inode && !(inode->flags & FS_INODE_INLINE)){
+        for(int i = 0; i < POINTERS_PER_INODE; i++)
+            if(inode->direct[i] > 0) count++;
+        if(inode->indirect)  tree_walk(inode->indirect, 1, count_visit, &count);
+        if(inode->dindirect) tree_walk(inode->dindirect, 2, count_visit, &count);
+        if(inode->tindirect) tree_walk(inode->tindirect, 3, count_visit, &count);
     }
-    int block_num = inumber / INODES_PER_BLOCK + 1;
-    union fs_block block;
-    disk_read(block_num, block.data);
-    int inode_index = inumber % INODES_PER_BLOCK;
-    if(!block.inode[inode_index].isvalid){
+    pthread_rwlock_unlock(inode_lock(inumber));
+    fs_leave();
+    if(!inode){
         printf("inode %d is invalid\n", inumber);
         return -1;
-    } else
-        return block.inode[inode_index].size;
+    }
+    return count;
 }
 
-int fs_read( int inumber, char *data, int length, int offset ){
-    if(!BEEN_MOUNTED){
-        printf("Disk needs to be mounted before you can read\n");
+int64_t fs_getsize( int inumber )
+{
+    if(!fs_enter("getsize")) return -1;
+    pthread_rwlock_rdlock(inode_lock(inumber));
+    struct fs_inode *inode = inode_lookup(inumber);
+    int64_t size = inode ? file_size(inumber, inode) : -1;
+    pthread_rwlock_unlock(inode_lock(inumber));
+    fs_leave();
+    if(size < 0) printf("inode %d is invalid\n", inumber);
+    return size;
+}
+
+int fs_read( int inumber, char *data, int length, int64_t offset ){
+    struct stats_call call;
+    stats_begin(&call);
+    if(!fs_enter("read")){
+        stats_end(&call, FS_OP_READ, 0);
         return 0;
     }
-    // get inode info
-    int block_num = inumber / INODES_PER_BLOCK + 1;
-    union fs_block block;
-    disk_read(block_num, block.data);
-    int inode_index = inumber % INODES_PER_BLOCK;
+    pthread_rwlock_rdlock(inode_lock(inumber));
+    int n = read_locked(inumber, data, length, offset);
+
+    // A short read is only a failure if it stopped before end of file
+    struct fs_inode *inode = inode_lookup(inumber);
+    int ok = inode && (n == length || offset + n >= file_size(inumber, inode));
+    pthread_rwlock_unlock(inode_lock(inumber));
+    fs_leave();
+    stats_end(&call, FS_OP_READ, ok);
+    stats_bytes(n, 0);
+    return n;
+}
+
+static int read_locked( int inumber, char *data, int length, int64_t offset ){
+
     // check if inode is valid
-    if(!block.inode[inode_index].isvalid){
+    struct fs_inode *inode = inode_lookup(inumber);
+    if(!inode){
         printf("inode %d is invalid\n", inumber);
         return 0;
     }
-    //printf("inode %d is valid\n", inumber);
+
+    // never read past the end of the file, counting writes not yet on disk
+    int64_t size = file_size(inumber, inode);
+    if(offset < 0 || offset >= size) return 0;
+    if(length > size - offset) length = size - offset;
+
+    // small files are served straight from their inline slot
+    if(inode->flags & FS_INODE_INLINE){
+        memcpy(data, inline_data(inumber) + offset, length);
+        return length;
+    }
+
+    struct fs_mapping map;
+    mapping_init(&map, inumber, inode);
+
+    // Reads this large keep the disk busy on their own; going through
+    // the readahead buffer would only add a copy
+    int streaming = length >= RA_MAX_WINDOW * DISK_BLOCK_SIZE;
+
+    // Blocks fetched straight into the caller's buffer are checked in
+    // batches once they land; the read stops short of any that fail
     int bytesread = 0;
-    int startblock = offset / 4096;
-    //printf("offset is %d so start reading at %d pointer\n", offset, startblock);
-    //while(bytesread < length){
-        // start reading from direct pointers
-        for(int i = startblock; i < POINTERS_PER_INODE; i++){
-            int b = block.inode[inode_index].direct[i];
-            //printf("direct pointer %d points to %d\n", i, b);
-            if(b){
-                // read data block
-                union fs_block data_block;
-                disk_read(b, data_block.data);
-                // copy that data to end of our char *data
-                int numbytes = sizeof(data_block.data);
-                memcpy(data + bytesread, data_block.data, numbytes);
-                //printf("copied %d bytes\n", numbytes);
-                // increment bytes read
-                bytesread += numbytes;
-                //printf("directly read %d out of %d bytes\n", bytesread, length);
-                if(bytesread >= length)
-                    return bytesread;
+    int pending = 0;
+    int limit = length;
+    struct read_run runs[READ_CHECK_RUNS];
+    int nruns = 0;
+
+    // The compressed cluster unpacked last, if any
+    char cluster[CLUSTER_SIZE];
+    int unpacked = -1;
+    while(bytesread < limit){
+
+        // work out which block holds the next byte and how much of it we want
+        int64_t pos = offset + bytesread;
+        int lblock = pos / DISK_BLOCK_SIZE;
+        int boff = pos % DISK_BLOCK_SIZE;
+        int numbytes = DISK_BLOCK_SIZE - boff;
+        if(numbytes > length - bytesread) numbytes = length - bytesread;
+
+        // held writes are newer than anything on disk
+        const char *page = pagebuf_get(inumber, lblock);
+        if(page){
+            memcpy(data + bytesread, page + boff, numbytes);
+            bytesread += numbytes;
+            continue;
+        }
+
+        // compressed clusters are unpacked whole, once for all the blocks
+        // of them the read wants
+        if(cluster_compressed(&map, lblock)){
+            if(lblock / CLUSTER_BLOCKS != unpacked){
+                int mask;
+                if(!cluster_load(&map, lblock / CLUSTER_BLOCKS, cluster, &mask)){
+                    limit = bytesread;
+                    break;
+                }
+                unpacked = lblock / CLUSTER_BLOCKS;
             }
+            memcpy(data + bytesread, cluster + (lblock % CLUSTER_BLOCKS) * DISK_BLOCK_SIZE + boff, numbytes);
+            bytesread += numbytes;
+            continue;
         }
-        //printf("finished reading direct blocks\n");
-        // once finished reading direct blocks, go to indirect blocks
-        int indirect_block_num = block.inode[inode_index].indirect;
-        //printf("indirect pointer points to %d\n", indirect_block_num);
-        // if indirect pointer is not null
-        if(indirect_block_num > 0){
-            union fs_block indirect_block;
-            // read indirect block
-            disk_read(indirect_block_num, indirect_block.data);
-            for(int i = startblock - 5; i < POINTERS_PER_BLOCK; i++){
-                int b = indirect_block.pointers[i];
-                //printf("indirect pointer %d points to %d\n", i, b);
-                if(b > 0){
-                    // if pointer is not null
-                    union fs_block data_block;
-                    // read data block
-                    disk_read(b, data_block.data);
-                    // copy that data to end of our char *data
-                    int numbytes = sizeof(data_block.data);
-                    memcpy(data + bytesread, data_block.data, numbytes);
-                    // increment bytes read
-                    bytesread += numbytes;
-                    //printf("indirectly read %d out of %d bytes\n", bytesread, length);
-                    if(bytesread >= length)
-                        return bytesread;
+
+        // take it from the readahead buffer if it has already been fetched
+        if(!streaming && readahead_copy(inumber, lblock, boff, data + bytesread, numbytes)){
+            bytesread += numbytes;
+            continue;
+        }
+
+        int b = block_map(&map, lblock, 0, 0);
+        if(!b){
+            // unallocated blocks read back as zeroes
+            memset(data + bytesread, 0, numbytes);
+        } else if(numbytes == DISK_BLOCK_SIZE){
+            // whole blocks go straight into the caller's buffer, and any
+            // that sit back to back on disk are fetched in one call
+            int run = 1;
+            while(length - bytesread >= (run + 1) * DISK_BLOCK_SIZE
+                  && block_map(&map, lblock + run, 0, 0) == b + run
+                  && !pagebuf_get(inumber, lblock + run))
+                run++;
+            __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+            disk_submit_read(b, run, data + bytesread, io_done, &pending);
+            if(csum_verifying()){
+                runs[nruns++] = (struct read_run){b, run, data + bytesread};
+                if(nruns == READ_CHECK_RUNS){
+                    io_wait(&pending);
+                    limit = read_check(runs, nruns, data, limit);
+                    nruns = 0;
                 }
             }
+            numbytes = run * DISK_BLOCK_SIZE;
+        } else {
+            union fs_block data_block;
+            if(!block_read(b, data_block.data)){
+                limit = bytesread;
+                break;
+            }
+            memcpy(data + bytesread, data_block.data + boff, numbytes);
+        }
+        bytesread += numbytes;
+    }
+
+    // Wait for every run we put in flight
+    io_wait(&pending);
+    limit = read_check(runs, nruns, data, limit);
+    if(bytesread > limit) bytesread = limit;
+
+    // If the reader is going through the file in order, start fetching
+    // the next window in the background while the caller uses this one
+    int window = streaming ? 0 : readahead_advance(inumber, offset, bytesread);
+    if(window > 0){
+        int first = (offset + bytesread) / DISK_BLOCK_SIZE;
+        int last  = (size - 1) / DISK_BLOCK_SIZE;
+        if(first + window - 1 < last) last = first + window - 1;
+
+        // The helper only knows plain blocks, so the window stops short
+        // of the next compressed cluster
+        int phys[RA_MAX_WINDOW];
+        for(int i = first; i <= last; i++){
+            if(cluster_compressed(&map, i)){
+                last = i - 1;
+                break;
+            }
+            phys[i - first] = block_map(&map, i, 0, 0);
         }
-    //}
+        if(last >= first) readahead_issue(inumber, first, last - first + 1, phys);
+    }
+
     return bytesread;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset ){
+int fs_write( int inumber, const char *data, int length, int64_t offset ){
 
-    if(!BEEN_MOUNTED){
-        printf("Disk needs to be mounted before you can read\n");
+    struct stats_call call;
+    stats_begin(&call);
+    if(!fs_enter("write")){
+        stats_end(&call, FS_OP_WRITE, 0);
         return 0;
     }
-    printf("INFO: fs_write got length %d and offset %d\n", length, offset);
+    info("fs_write got length %d and offset %lld\n", length, (long long)offset);
+    pthread_rwlock_wrlock(inode_lock(inumber));
+    int n = delayed_write(inumber, data, length, offset);
+    if(n < 0){
+        txn_begin(write_credits(length));
+        n = write_locked(inumber, data, length, offset);
+        txn_end();
+    }
+    pthread_rwlock_unlock(inode_lock(inumber));
+    fs_leave();
+    stats_end(&call, FS_OP_WRITE, n == length);
+    stats_bytes(0, n);
+    return n;
+}
 
-    // Get the super block for some sanity checks
-    union fs_block superblock;;
-    disk_read(0, superblock.data);
+static int write_locked( int inumber, const char *data, int length, int64_t offset ){
 
     // Perform checks on passed inumber
-    if(inumber <= 0 || inumber > superblock.super.ninodes){
+    if(inumber <= 0 || inumber >= SUPER.ninodes){
         printf("ERROR: inumber '%d' out of range.\n", inumber);
         return 0;
     }
 
-    // Get the block and index to get the inode itself
-    int blockno = inumber / INODES_PER_BLOCK + 1
-      , i_index = inumber % INODES_PER_BLOCK;
-
-    union fs_block block;
-    disk_read(blockno, block.data);
-
     // More sanity checks
-    if(!block.inode[i_index].isvalid){
+    struct fs_inode *inode = inode_lookup(inumber);
+    if(!inode){
         printf("ERROR: Inode #%d is invalid!\n", inumber);
         return 0;
     }
-
-    // Initialize helper data
-    int bytes_written = 0
-      , start_block   = offset / DISK_BLOCK_SIZE;
+    if(offset < 0) return 0;
+
+    // Anything prefetched for this file is about to go stale
+    readahead_invalidate(inumber);
+
+    // Small files live in an inline slot until they outgrow it
+    int inlined = inline_write(inumber, inode, data, length, offset);
+    if(inlined >= 0) return inlined;
+
+    // Pointer changes are collected here and written once at the end
+    struct fs_mapping map;
+    mapping_init(&map, inumber, inode);
+
+    // Nothing can be stored past the deepest pointer tree
+    if(offset >= (int64_t)max_file_blocks() * DISK_BLOCK_SIZE) return 0;
+
+    // Lay the whole write out contiguously before touching any data,
+    // starting from the first block if the inline data is moving out
+    // there. Only the blocks written are reserved: a write far past the
+    // end leaves a hole, and the inline data is moved on its own.
+    int spilling = inode->flags & FS_INODE_INLINE;
+    int first = offset / DISK_BLOCK_SIZE;
+    if(spilling && first < POINTERS_PER_INODE) first = 0;
+    if(ALLOC_MODE == FS_ALLOC_EXTENT && length > 0)
+        reserve_extents(&map, first, (offset + length - 1) / DISK_BLOCK_SIZE);
+    if(spilling && !inline_spill(&map)){
+        release_extents(&map);
+        return 0;
+    }
 
     // Write them bytes
-    for(int i = start_block; i < POINTERS_PER_INODE; i++){
+    int bytes_written = 0;
+    int pending = 0;
+    if(SUPER.compression){
+        // Compressed images are written a cluster at a time
+        bytes_written = compressed_write(&map, data, length, offset);
+    } else if(dedup_active()){
+        // Deduplicating ones a block at a time
+        bytes_written = dedup_write(&map, data, length, offset);
+    } else {
+        while(bytes_written < length){
+
+            int64_t pos = offset + bytes_written;
+            int lblock = pos / DISK_BLOCK_SIZE;
+            int boff = pos % DISK_BLOCK_SIZE;
+            int numbytes = DISK_BLOCK_SIZE - boff;
+            if(numbytes > length - bytes_written) numbytes = length - bytes_written;
+
+            // Find (or allocate) the data block backing this offset
+            int fresh = 0;
+            int b = block_map(&map, lblock, 1, &fresh);
+            if(!b) break;
+
+            if(numbytes == DISK_BLOCK_SIZE){
+                // Whole blocks are written straight from the caller's buffer,
+                // a physically contiguous run at a time
+                int run = 1;
+                while(length - bytes_written >= (run + 1) * DISK_BLOCK_SIZE
+                      && block_map(&map, lblock + run, 1, 0) == b + run)
+                    run++;
+                __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+                csum_update(b, run, data + bytes_written);
+                disk_submit_write(b, run, data + bytes_written, io_done, &pending);
+                numbytes = run * DISK_BLOCK_SIZE;
+            } else {
+                // Partial blocks need the old contents merged in. A bad
+                // block is reported, and rewritten with what we have.
+                union fs_block data_block;
+                if(fresh) memset(data_block.data, 0, sizeof(data_block.data));
+                else block_read(b, data_block.data);
+                memcpy(data_block.data + boff, data + bytes_written, numbytes);
+                block_write(b, data_block.data);
+            }
+            bytes_written += numbytes;
+        }
+    }
+
+    // Commit in dependency order: the data lands first, then the
+    // pointer blocks that lead to it, then the inode and free map
+    io_wait(&pending);
+    mapping_commit(&map);
+
+    // Hand back anything reserved but not used
+    release_extents(&map);
 
-        // Find out if inode has direct block ready
-        if(block.inode[i_index].direct[i]){
+    // Grow the file if we wrote past its end
+    if(offset + bytes_written > inode->size)
+        inode->size = offset + bytes_written;
+    inode_dirty(inumber);
 
-            // Write 4kb at a time
-            printf("INFO: Writing to direct block %d\n", block.inode[i_index].direct[i]);
-            disk_write(block.inode[i_index].direct[i], data + bytes_written);
-            G_FREE_BLOCK_BITMAP[block.inode[i_index].direct[i]] = 1;
-            bytes_written += DISK_BLOCK_SIZE;
+    return bytes_written;
+}
+
+static int delayed_write( int inumber, const char *data, int length, int64_t offset ){
+
+    // Hold a small write to a block-mapped file in the page buffer.
+    // Returns -1 if it has to be written the direct way instead, after
+    // anything already held for the file. A file that can still be kept
+    // inline is left to inline_write, or flushing it would give it a
+    // block.
+    struct fs_inode *inode = inode_lookup(inumber);
+    if(!inode) return -1;
+    int inlinable = INLINE_TABLE && offset >= 0 && offset + length <= FS_INLINE_MAX
+                    && !(inode->size > 0 || pagebuf_count(inumber));
+    if(!DELALLOC || (inode->flags & FS_INODE_INLINE) || inlinable || offset < 0
+       || length <= 0 || length > DELALLOC_WRITE_MAX
+       || offset + length > (int64_t)max_file_blocks() * DISK_BLOCK_SIZE){
+        delayed_flush(inumber);
+        return -1;
+    }
 
-            block.inode[i_index].size += DISK_BLOCK_SIZE;
-            disk_write(blockno, block.data);
+    int first = offset / DISK_BLOCK_SIZE;
+    int last  = (offset + length - 1) / DISK_BLOCK_SIZE;
+    struct fs_mapping map;
+    mapping_init(&map, inumber, inode);
+
+    // The blocks have to be there when the buffer is flushed, so count
+    // what this adds to the blocks already promised, pointer blocks
+    // included, against what is free
+    int needed = 0;
+    for(int i = first; i <= last; i++)
+        if(!pagebuf_get(inumber, i) && block_map(&map, i, 0, 0) <= 0) needed++;
+    int nfree = __atomic_load_n(&G_FREE_BLOCK_BITMAP.nfree, __ATOMIC_RELAXED);
+    if((needed && blocks_promised(pagebuf_unmapped() + needed) > nfree)
+       || !pagebuf_reserve(inumber, last - first + 1, inode->size)){
+        delayed_flush(inumber);
+        return -1;
+    }
 
-            if(bytes_written >= length) return bytes_written;
+    readahead_invalidate(inumber);
+    int done = 0;
+    while(done < length){
+
+        int64_t pos = offset + done;
+        int lblock = pos / DISK_BLOCK_SIZE;
+        int boff = pos % DISK_BLOCK_SIZE;
+        int numbytes = DISK_BLOCK_SIZE - boff;
+        if(numbytes > length - done) numbytes = length - done;
+
+        // A new page starts out as the block on disk, or zeroes if there
+        // is none; a write covering all of it needs neither
+        char *page = pagebuf_get(inumber, lblock);
+        if(!page){
+            page = pagebuf_add(inumber, lblock, block_map(&map, lblock, 0, 0) <= 0);
+            if(numbytes < DISK_BLOCK_SIZE) lblock_read(&map, lblock, page);
         }
+        memcpy(page + boff, data + done, numbytes);
+        done += numbytes;
+    }
+    if(offset + length > pagebuf_size(inumber))
+        pagebuf_set_size(inumber, offset + length);
+
+    // Lay the file out once it has gathered enough to be worth it, or
+    // sooner if all the buffers together are taking too much memory
+    if(pagebuf_count(inumber) >= PAGEBUF_FILE_MAX || pagebuf_total() >= PAGEBUF_MAX)
+        delayed_flush(inumber);
+    return length;
+}
 
-        // Otherwise allocate a new block
-        // If there's room for another direct pointer...
-        else if(i < POINTERS_PER_INODE){
+static void delayed_flush( int inumber ){
+
+    // Give every block held for the file its place on disk in one go,
+    // then write them out a contiguous run at a time. Caller holds the
+    // inode's lock exclusively.
+    const int *lblocks;
+    char *pages;
+    int n = pagebuf_sorted(inumber, &lblocks, &pages);
+    if(!n) return;
+    struct fs_inode *inode = &INODE_TABLE[inumber];
+    txn_begin(write_credits(n * DISK_BLOCK_SIZE));
+    readahead_invalidate(inumber);
+
+    struct fs_mapping map;
+    mapping_init(&map, inumber, inode);
+    map.promised = 1;
+    if(ALLOC_MODE == FS_ALLOC_EXTENT){
+        int needed = 0;
+        for(int i = 0; i < n; i++){
+            if(block_map(&map, lblocks[i], 0, 0) <= 0) needed++;
+            if(i == 0 || (lblocks[i] >= POINTERS_PER_INODE
+                          && (lblocks[i] - POINTERS_PER_INODE) / SINGLE_SPAN
+                             != (lblocks[i - 1] - POINTERS_PER_INODE) / SINGLE_SPAN))
+                needed += block_path_missing(&map, lblocks[i]);
+        }
+        reserve_blocks(&map, lblocks[0], needed);
+    }
 
-            // Locate the next free block
-            int target_block = next_free_block();
-            if(!target_block) return 0;
+    int pending = 0;
+    if(SUPER.compression){
+        compressed_flush(&map, lblocks, pages, n);
+    } else if(dedup_active()){
+        for(int i = 0; i < n; i++)
+            if(!dedup_store(&map, lblocks[i], pages + (size_t)i * DISK_BLOCK_SIZE)) break;
+    } else {
+        for(int i = 0; i < n; ){
+            int b = block_map(&map, lblocks[i], 1, 0);
+            if(!b) break;
+            int run = 1;
+            while(i + run < n && lblocks[i + run] == lblocks[i] + run
+                  && block_map(&map, lblocks[i + run], 1, 0) == b + run)
+                run++;
+            __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+            csum_update(b, run, pages + (size_t)i * DISK_BLOCK_SIZE);
+            disk_submit_write(b, run, pages + (size_t)i * DISK_BLOCK_SIZE, io_done, &pending);
+            i += run;
+        }
+    }
 
-            // Update the indode and the bitmap
-            block.inode[i_index].direct[i] = target_block;
-            block.inode[i_index].size += DISK_BLOCK_SIZE;
-            disk_write(blockno, block.data);
-            G_FREE_BLOCK_BITMAP[target_block] = 1;
+    // Same order as fs_write: data, pointer blocks, then the inode
+    io_wait(&pending);
+    mapping_commit(&map);
+    release_extents(&map);
+    if(pagebuf_size(inumber) > inode->size) inode->size = pagebuf_size(inumber);
+    inode_dirty(inumber);
+    txn_end();
+    pagebuf_drop(inumber);
+}
 
-            // Write the data
-            printf("INFO: Writing to allocated direct block %d\n", target_block);
-            disk_write(target_block, data + bytes_written);
-            bytes_written += DISK_BLOCK_SIZE;
+static void delayed_flush_all(){
 
-            if(bytes_written >= length) return bytes_written;
+    // Flush every file with writes held, a batch of them at a time
+    int inumbers[64];
+    int n;
+    while((n = pagebuf_files(inumbers, 64)) > 0){
+        for(int i = 0; i < n; i++){
+            pthread_rwlock_wrlock(inode_lock(inumbers[i]));
+            delayed_flush(inumbers[i]);
+            pthread_rwlock_unlock(inode_lock(inumbers[i]));
         }
     }
+}
+
+static int64_t file_size( int inumber, struct fs_inode *inode ){
 
-    // If there's still data to be written, use indirection, else done
-    if(bytes_written >= length) return bytes_written;
+    // The size a valid inode has with its held writes
+    int64_t size = pagebuf_size(inumber);
+    return size > inode->size ? size : inode->size;
+}
 
-    // If the inode's indirect pointer isn't set, find a block for it
-    if(!block.inode[i_index].indirect){
+int fs_punch_hole( int inumber, int64_t offset, int64_t length ){
+
+    if(!fs_enter("punch a hole")) return 0;
+    pthread_rwlock_wrlock(inode_lock(inumber));
+    delayed_flush(inumber);
+
+    // The inode block, the pointer blocks only partly inside the hole
+    // (at most two per level of each tree), any of the free map, and the
+    // checksums of those pointer blocks and the two partial data blocks
+    // (and their copies, if shared), and the dedup entries of every block
+    // let go of
+    int csum = SUPER.version >= FS_VERSION_CHECKSUM ? 11 + 2 + (SUPER.ndedupblocks ? 2 : 0) : 0;
+    txn_begin(1 + 11 + SUPER.nbitmapblocks + csum + SUPER.ndedupblocks);
+    int ok = punch_locked(inumber, offset, length);
+    txn_end();
+    pthread_rwlock_unlock(inode_lock(inumber));
+    fs_leave();
+    return ok;
+}
 
-        // Locate the next open block
-        int target_block = next_free_block();
-        if(!target_block) return 0;
+static int punch_locked( int inumber, int64_t offset, int64_t length ){
 
-        // If a free block was found, update the inode and save changes
-        block.inode[i_index].indirect = target_block;
-        disk_write(blockno, block.data);
+    struct fs_inode *inode = inode_lookup(inumber);
+    if(!inode){
+        printf("ERROR: Inode #%d is invalid!\n", inumber);
+        return 0;
     }
+    if(offset < 0 || length < 0) return 0;
 
-    // Read in the indirect block
-    union fs_block indirect_block;
-    disk_read(block.inode[i_index].indirect, indirect_block.data);
+    // Only the part inside the file; its size stays as it is
+    if(offset >= inode->size) return 1;
+    int64_t end = length < inode->size - offset ? offset + length : inode->size;
+    if(end == offset) return 1;
 
-    for(int i = start_block - 5; i < POINTERS_PER_BLOCK; i++){
+    readahead_invalidate(inumber);
 
-        // If the indrect data block has already been allocated...
-        if(indirect_block.pointers[i] > 0 && indirect_block.pointers[i] < superblock.super.nblocks){
+    if(inode->flags & FS_INODE_INLINE){
+        memset(inline_data(inumber) + offset, 0, end - offset);
+        inline_dirty(inumber);
+        return 1;
+    }
 
-            // Update the bitmap
-            printf("INFO: Accessing global bitmap at index %d\n", indirect_block.pointers[i]);
-            G_FREE_BLOCK_BITMAP[indirect_block.pointers[i]] = 1;
-            block.inode[i_index].size += DISK_BLOCK_SIZE;
-            disk_write(blockno, block.data);
+    struct fs_mapping map;
+    mapping_init(&map, inumber, inode);
+
+    // Blocks only partly inside the hole keep the rest of their bytes,
+    // unless the rest is past the end of the file
+    if(end == inode->size) end = (end + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE * DISK_BLOCK_SIZE;
+    if(SUPER.compression){
+        compressed_punch(&map, offset, end);
+        mapping_commit(&map);
+        inode_dirty(inumber);
+        return 1;
+    }
+    int first = (offset + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int last  = end / DISK_BLOCK_SIZE;
+    if(offset % DISK_BLOCK_SIZE){
+        int64_t stop = (offset / DISK_BLOCK_SIZE + 1) * DISK_BLOCK_SIZE;
+        punch_partial(&map, offset, stop < end ? stop : end);
+    }
+    if(end % DISK_BLOCK_SIZE && last >= first)
+        punch_partial(&map, (int64_t)last * DISK_BLOCK_SIZE, end);
+
+    // The rest go back to the free map, along with any pointer blocks
+    // that no longer lead anywhere
+    if(first < last) unmap_range(&map, first, last - 1);
+    mapping_commit(&map);
+    inode_dirty(inumber);
+    return 1;
+}
+
+static void punch_partial( struct fs_mapping *map, int64_t start, int64_t end ){
 
-            // Write the data, update bytes written
-            disk_write(indirect_block.pointers[i], data + bytes_written);
-            bytes_written += DISK_BLOCK_SIZE;
-            printf("INFO: Writing to indirect block %d\n", indirect_block.pointers[i]);
-            if(bytes_written >= length) return bytes_written;
+    // Zero part of one block, if there is a block there at all
+    int b = block_map(map, start / DISK_BLOCK_SIZE, 0, 0);
+    if(!b) return;
+    union fs_block block;
+    block_read(b, block.data);
+    memset(block.data + start % DISK_BLOCK_SIZE, 0, end - start);
+    if(dedup_active()) dedup_store(map, start / DISK_BLOCK_SIZE, block.data);
+    else block_write(b, block.data);
+}
+
+static void unmap_range( struct fs_mapping *map, int first, int last ){
+
+    // Free logical blocks first..last (inclusive) of the file
+    struct fs_inode *inode = map->inode;
+    struct free_run run = {0, 0};
+    for(int i = first; i <= last && i < POINTERS_PER_INODE; i++){
+        free_visit(&run, inode->direct[i], 0);
+        inode->direct[i] = 0;
+    }
+
+    // Then the part of each pointer tree the range reaches into. A tree
+    // left with no pointers at all goes too.
+    int *roots[3] = {&inode->indirect, &inode->dindirect, &inode->tindirect};
+    int base = POINTERS_PER_INODE;
+    for(int depth = 1; depth <= 3; depth++){
+        int span = level_span(depth) * POINTERS_PER_BLOCK;
+        int *root = roots[depth - 1];
+        if(*root && first < base + span && last >= base
+           && unmap_tree(map, &run, *root, depth, first - base, last - base)){
+            free_visit(&run, *root, depth);
+            *root = 0;
+        }
+        base += span;
+    }
+    if(run.count) free_blocks(run.start, run.count);
+}
+
+static int unmap_tree( struct fs_mapping *map, struct free_run *run, int blocknum, int depth, int first, int last ){
+
+    // Clear the pointers in blocknum that cover first..last, counted from
+    // the first block under it, freeing whatever they led to. Returns 1
+    // if blocknum is left empty.
+    int span = level_span(depth);
+    int k0 = first < 0 ? 0 : first / span;
+    int k1 = last / span < POINTERS_PER_BLOCK ? last / span : POINTERS_PER_BLOCK - 1;
+    for(int k = k0; k <= k1; k++){
+        int b = ptrcache_get(blocknum, k);
+        if(!b || b >= SUPER.nblocks || (b < 0 && depth > 1)) continue;
+        int lo = k * span;
+        if(depth == 1){
+            // A compressed cluster's marker has nothing to free
+            free_visit(run, b, 0);
+        } else if(first <= lo && last >= lo + span - 1){
+            // Entirely inside the hole: the whole subtree goes
+            tree_walk(b, depth - 1, free_visit, run);
+        } else if(unmap_tree(map, run, b, depth - 1, first - lo, last - lo)){
+            free_visit(run, b, depth - 1);
+        } else {
+            continue;
+        }
+        ptrcache_set(map->inumber, blocknum, k, 0);
+    }
+    return ptrcache_empty(blocknum);
+}
+
+static int dedup_write( struct fs_mapping *map, const char *data, int length, int64_t offset ){
+
+    // Store a write on a deduplicating image one block at a time, so each
+    // can be matched against what is already on disk. Partial blocks have
+    // the old contents merged in first. Returns the bytes written.
+    union fs_block block;
+    int done = 0;
+    while(done < length){
+
+        int64_t pos = offset + done;
+        int lblock = pos / DISK_BLOCK_SIZE;
+        int boff = pos % DISK_BLOCK_SIZE;
+        int numbytes = DISK_BLOCK_SIZE - boff;
+        if(numbytes > length - done) numbytes = length - done;
+
+        const char *src = data + done;
+        if(numbytes < DISK_BLOCK_SIZE){
+            lblock_read(map, lblock, block.data);
+            memcpy(block.data + boff, data + done, numbytes);
+            src = block.data;
         }
+        if(!dedup_store(map, lblock, src)) break;
+        done += numbytes;
+    }
+    return done;
+}
 
-        // Otherwise allocte a new block
-        else{
+static int dedup_store( struct fs_mapping *map, int lblock, const char *data ){
+
+    // Point lblock at a block holding data: one already on disk with the
+    // same contents if there is one, otherwise the file's own block,
+    // rewritten in place unless other files share it. Returns 0 if the
+    // disk is full.
+    uint64_t hash = blockhash(data, DISK_BLOCK_SIZE);
+    int old = block_map(map, lblock, 0, 0);
+    int b = dedup_lookup(hash);
+    if(b && b == old && block_same(b, data)) return 1;
+    if(b && b != old && dedup_share(b, hash)){
+        // The reference taken keeps the block from being rewritten or
+        // freed while it is compared; fingerprints can collide
+        if(block_same(b, data) && block_set(map, lblock, b)){
+            if(old && dedup_release(old)) free_blocks(old, 1);
+            return 1;
+        }
+        if(dedup_release(b)) free_blocks(b, 1);
+    }
 
-            // Find the block
-            int target_block = next_free_block();
-            if(!target_block) return 0;
+    if(old && dedup_claim(old, hash)){
+        block_write(old, data);
+        return 1;
+    }
+    int nb = next_free_block(map);
+    if(!nb) return 0;
+    block_write(nb, data);
+    dedup_record(nb, hash);
+    if(!block_set(map, lblock, nb)){
+        dedup_release(nb);
+        free_blocks(nb, 1);
+        return 0;
+    }
+    if(old && dedup_release(old)) free_blocks(old, 1);
+    return 1;
+}
 
-            // Update the indrect pointer list, save changes, update bitmap
-            indirect_block.pointers[i] = target_block;
-            disk_write(block.inode[i_index].indirect, indirect_block.data);
-            G_FREE_BLOCK_BITMAP[target_block] = 1;
+static int block_same( int blocknum, const char *data ){
 
-            block.inode[i_index].size += DISK_BLOCK_SIZE;
-            disk_write(blockno, block.data);
+    // Whether a block on disk holds exactly data
+    union fs_block block;
+    disk_read(blocknum, block.data);
+    return !memcmp(block.data, data, DISK_BLOCK_SIZE);
+}
 
-            // Write the raw data and update bytes written
-            disk_write(target_block, data + bytes_written);
-            printf("INFO: Writing to allocated indirect block %d\n", target_block);
-            if(bytes_written >= length) return bytes_written;
+static int compressed_write( struct fs_mapping *map, const char *data, int length, int64_t offset ){
+
+    // Store a write on a compressed image. A cluster it covers entirely
+    // is packed straight from the caller's buffer; one it only covers
+    // part of is unpacked and patched first. A bad cluster is reported,
+    // and rewritten with what we have. Returns the bytes written.
+    char cluster[CLUSTER_SIZE];
+    int done = 0;
+    while(done < length){
+
+        int64_t pos = offset + done;
+        int c = pos / CLUSTER_SIZE;
+        int coff = pos % CLUSTER_SIZE;
+        int numbytes = CLUSTER_SIZE - coff;
+        if(numbytes > length - done) numbytes = length - done;
+        int first = coff / DISK_BLOCK_SIZE;
+        int last  = (coff + numbytes - 1) / DISK_BLOCK_SIZE;
+        int dirty = ((1 << (last + 1)) - 1) & ~((1 << first) - 1);
+
+        const char *src = data + done;
+        int mask = 0;
+        if(numbytes < CLUSTER_SIZE){
+            cluster_load(map, c, cluster, &mask);
+            memcpy(cluster + coff, data + done, numbytes);
+            src = cluster;
         }
+        if(!cluster_store(map, c, src, mask | dirty, dirty)) break;
+        done += numbytes;
     }
+    return done;
+}
 
-    // Now we should be done
-    return bytes_written;
+static void compressed_flush( struct fs_mapping *map, const int *lblocks, const char *pages, int n ){
+
+    // Write out a file's held pages on a compressed image, one cluster
+    // at a time. The pages are in logical block order, so a cluster held
+    // in full is already back to back in memory.
+    char cluster[CLUSTER_SIZE];
+    for(int i = 0; i < n; ){
+        int c = lblocks[i] / CLUSTER_BLOCKS;
+        int j = i;
+        int dirty = 0;
+        while(j < n && lblocks[j] / CLUSTER_BLOCKS == c)
+            dirty |= 1 << (lblocks[j++] % CLUSTER_BLOCKS);
+
+        const char *src = pages + (size_t)i * DISK_BLOCK_SIZE;
+        int mask = 0;
+        if(j - i < CLUSTER_BLOCKS){
+            cluster_load(map, c, cluster, &mask);
+            for(int k = i; k < j; k++)
+                memcpy(cluster + (lblocks[k] % CLUSTER_BLOCKS) * DISK_BLOCK_SIZE,
+                       pages + (size_t)k * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            src = cluster;
+        }
+        if(!cluster_store(map, c, src, mask | dirty, dirty)) break;
+        i = j;
+    }
 }
 
-int next_free_block(){
+static void compressed_punch( struct fs_mapping *map, int64_t start, int64_t end ){
 
-    // Get the super block for nblocks
-    union fs_block superblock;
-    disk_read(0, superblock.data);
+    // punch_locked for compressed images: the same, a cluster at a time
+    int first = (start + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int last  = end / CLUSTER_SIZE;
+    if(start % CLUSTER_SIZE){
+        int64_t stop = (start / CLUSTER_SIZE + 1) * CLUSTER_SIZE;
+        punch_cluster(map, start, stop < end ? stop : end);
+    }
+    if(end % CLUSTER_SIZE && last >= first)
+        punch_cluster(map, (int64_t)last * CLUSTER_SIZE, end);
+    if(first < last) unmap_range(map, first * CLUSTER_BLOCKS, last * CLUSTER_BLOCKS - 1);
+}
+
+static void punch_cluster( struct fs_mapping *map, int64_t start, int64_t end ){
+
+    // Zero part of one cluster. Blocks left entirely inside the hole
+    // become holes themselves.
+    char cluster[CLUSTER_SIZE];
+    int mask;
+    cluster_load(map, start / CLUSTER_SIZE, cluster, &mask);
+    if(!mask) return;
+    int lo = start % CLUSTER_SIZE;
+    int hi = lo + (end - start);
+    memset(cluster + lo, 0, hi - lo);
+    int dirty = 0;
+    for(int i = 0; i < CLUSTER_BLOCKS; i++){
+        if(lo <= i * DISK_BLOCK_SIZE && hi >= (i + 1) * DISK_BLOCK_SIZE) mask &= ~(1 << i);
+        else if(lo < (i + 1) * DISK_BLOCK_SIZE && hi > i * DISK_BLOCK_SIZE) dirty |= 1 << i;
+    }
+    cluster_store(map, start / CLUSTER_SIZE, cluster, mask, dirty & mask);
+}
+
+void fs_set_mount_threads( int n ){
+    MOUNT_THREADS = n > 0 ? n : 1;
+}
+
+void fs_set_alloc_mode( int mode ){
+    ALLOC_MODE = mode;
+}
+
+void fs_set_compression( int mode ){
+    COMPRESSION = mode;
+}
+
+void fs_set_dedup( int on ){
+    DEDUP = on;
+}
+
+void fs_set_verify( int on ){
+    csum_set_verify(on);
+}
+
+void fs_set_delalloc( int on ){
+    DELALLOC = on;
+}
+
+void fs_set_verbose( int on ){
+    VERBOSE = on;
+}
+
+static void info( const char *format, ... ){
+    if(!VERBOSE) return;
+    va_list args;
+    va_start(args, format);
+    printf("INFO: ");
+    vprintf(format, args);
+    va_end(args);
+}
+
+static int fs_enter( const char *op ){
+
+    // Hold off format, mount and unmount for the length of the call
+    pthread_rwlock_rdlock(&FS_LOCK);
+    if(BEEN_MOUNTED) return 1;
+    pthread_rwlock_unlock(&FS_LOCK);
+    printf("Disk needs to be mounted before you can %s\n", op);
+    return 0;
+}
+
+static void fs_leave(){
+    pthread_rwlock_unlock(&FS_LOCK);
+}
+
+static void inode_locks_init(){
+    for(int i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_init(&INODE_LOCKS[i], 0);
+}
 
-    // Scan the bitmap for an opening
-    for(int i = 1; i < superblock.super.nblocks; i++)
-        if(!G_FREE_BLOCK_BITMAP[i]) return i;
+static pthread_rwlock_t *inode_lock( int inumber ){
+    pthread_once(&INODE_LOCKS_ONCE, inode_locks_init);
+    return &INODE_LOCKS[(unsigned)inumber % INODE_LOCK_STRIPES];
+}
+
+static void io_done( void *arg, int blocknum, int count ){
+    __atomic_sub_fetch((int *)arg, 1, __ATOMIC_RELEASE);
+}
+
+static void io_wait( int *pending ){
+
+    // Other threads share the disk queue, so wait on our own requests
+    // rather than draining everyone's
+    while(__atomic_load_n(pending, __ATOMIC_ACQUIRE))
+        if(!disk_poll(1)) sched_yield();
+}
+
+static void alloc_shards_init(){
+
+    // Split the free map into word-aligned ranges, none smaller than
+    // MIN_ALLOC_SHARD_BITS, so shards never share a bitmap word
+    int n = SUPER.nblocks / MIN_ALLOC_SHARD_BITS;
+    if(n > MAX_ALLOC_SHARDS) n = MAX_ALLOC_SHARDS;
+    if(n < 1) n = 1;
+    int per_shard = DIVIDE(SUPER.nblocks, n);
+    per_shard = DIVIDE(per_shard, 64) * 64;
+    for(int i = 0; i < n; i++){
+        struct alloc_shard *shard = &ALLOC_SHARDS[i];
+        if(i >= NALLOC_SHARDS) pthread_mutex_init(&shard->lock, 0);
+        shard->lo = i * per_shard;
+        shard->hi = i == n - 1 ? SUPER.nblocks : (i + 1) * per_shard;
+        shard->cursor = shard->lo;
+    }
+    if(n > NALLOC_SHARDS) NALLOC_SHARDS = n;
+    for(int i = n; i < NALLOC_SHARDS; i++)
+        ALLOC_SHARDS[i].lo = ALLOC_SHARDS[i].hi = SUPER.nblocks;
+}
+
+static struct alloc_shard *alloc_shard_of( int blocknum ){
+    int per_shard = ALLOC_SHARDS[0].hi - ALLOC_SHARDS[0].lo;
+    int i = blocknum / per_shard;
+    return &ALLOC_SHARDS[i < NALLOC_SHARDS ? i : NALLOC_SHARDS - 1];
+}
+
+static int next_free_block( struct fs_mapping *map ){
+
+    // Use up any extent reserved for the current write first
+    for(int i = 0; i < map->nreserved; i++){
+        if(!map->reserved[i].length) continue;
+        map->reserved[i].length--;
+        return map->reserved[i].start++;
+    }
+
+    // Claim the next opening in the inode's home shard, or failing
+    // that, in whichever shard comes next
+    for(int i = 0; i < NALLOC_SHARDS && blocks_spare(map) > 0; i++){
+        struct alloc_shard *shard = &ALLOC_SHARDS[(map->inumber + i) % NALLOC_SHARDS];
+        if(shard->lo >= shard->hi) continue;
+        pthread_mutex_lock(&shard->lock);
+        int b = bitmap_alloc_range(&G_FREE_BLOCK_BITMAP, shard->lo, shard->hi, &shard->cursor);
+        pthread_mutex_unlock(&shard->lock);
+        if(b > 0) return b;
+    }
     printf("ERROR: No free blocks.\n");
     return 0;
 }
 
+static int blocks_spare( struct fs_mapping *map ){
+
+    // Free blocks this mapping may take. Writes held in the page buffer
+    // were accepted on the promise that their blocks would be there, so
+    // anything but a page buffer flush has to leave those alone.
+    int nfree = __atomic_load_n(&G_FREE_BLOCK_BITMAP.nfree, __ATOMIC_RELAXED);
+    int unmapped = pagebuf_unmapped();
+    if(map->promised || !unmapped) return nfree;
+    return nfree - blocks_promised(unmapped);
+}
+
+static int blocks_promised( int unmapped ){
+    // Blocks held back for unmapped pages, with room for their pointer blocks
+    return unmapped + unmapped / POINTERS_PER_BLOCK + 8;
+}
+
+static void free_blocks( int start, int count ){
+
+    // Give a run of blocks back, one shard's worth at a time
+    while(count > 0){
+        struct alloc_shard *shard = alloc_shard_of(start);
+        int n = shard->hi - start < count ? shard->hi - start : count;
+        pthread_mutex_lock(&shard->lock);
+        bitmap_clear_range(&G_FREE_BLOCK_BITMAP, start, n);
+        pthread_mutex_unlock(&shard->lock);
+        start += n;
+        count -= n;
+    }
+}
+
+static int data_start(){
+
+    // First block past the fixed metadata regions
+    int start = 1 + SUPER.ninodeblocks + SUPER.ninlineblocks;
+    if(SUPER.version >= FS_VERSION_FREEMAP) start += SUPER.nbitmapblocks;
+    if(SUPER.version >= FS_VERSION_JOURNAL) start += SUPER.njournalblocks;
+    if(SUPER.version >= FS_VERSION_CHECKSUM) start += SUPER.ncsumblocks;
+    if(SUPER.version >= FS_VERSION_DEDUP) start += SUPER.ndedupblocks;
+    return start;
+}
+
+static int inode_map_build(){
+
+    bitmap_destroy(&INODE_MAP);
+    if(!bitmap_init(&INODE_MAP, SUPER.ninodes)) return 0;
+    bitmap_set(&INODE_MAP, 0);
+    for(int i = 1; i < SUPER.ninodes; i++)
+        if(INODE_TABLE[i].isvalid)
+            bitmap_set(&INODE_MAP, i);
+    return 1;
+}
+
+static void super_write(){
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    block.super = SUPER;
+    disk_write(0, block.data);
+}
+
+static void freemap_load(){
+
+    // Read the whole persistent free map straight into the bitmap words
+    int n = SUPER.nbitmapblocks;
+    union fs_block *blocks = malloc(sizeof(union fs_block) * n);
+    for(int i = 0; i < n; i += MOUNT_BATCH_BLOCKS){
+        int count = n - i < MOUNT_BATCH_BLOCKS ? n - i : MOUNT_BATCH_BLOCKS;
+        disk_submit_read(SUPER.bitmapstart + i, count, blocks[i].data, 0, 0);
+    }
+    disk_drain();
+
+    memcpy(G_FREE_BLOCK_BITMAP.words, blocks, G_FREE_BLOCK_BITMAP.nwords * sizeof(uint64_t));
+    free(blocks);
+
+    // The metadata regions are in use no matter what the map says
+    bitmap_recount(&G_FREE_BLOCK_BITMAP);
+    bitmap_set_range(&G_FREE_BLOCK_BITMAP, 0, data_start());
+    for(int i = 0; i < n; i++) bitmap_chunk_clean(&G_FREE_BLOCK_BITMAP, i);
+}
+
+static void freemap_flush( void (*write)( int blocknum, const char *data ) ){
+
+    // Write back each block of the free map that changed since last time
+    if(SUPER.version < FS_VERSION_FREEMAP) return;
+    struct bitmap *map = &G_FREE_BLOCK_BITMAP;
+    for(int i = 0; i < bitmap_nchunks(map) && i < SUPER.nbitmapblocks; i++){
+        if(!bitmap_chunk_dirty(map, i)) continue;
+        bitmap_chunk_clean(map, i);
+        union fs_block block;
+        int words = map->nwords - i * BITMAP_WORDS_PER_BLOCK;
+        if(words > BITMAP_WORDS_PER_BLOCK) words = BITMAP_WORDS_PER_BLOCK;
+        memset(block.data, 0, sizeof(block.data));
+        memcpy(block.data, map->words + (size_t)i * BITMAP_WORDS_PER_BLOCK, words * sizeof(uint64_t));
+        write(SUPER.bitmapstart + i, block.data);
+    }
+}
+
+static const union fs_block *block_view( int blocknum, union fs_block *buf ){
+
+    // Read-only access to a block: in place when the disk is memory
+    // mapped, otherwise copied into the caller's buffer. The journal may
+    // hold a newer copy than either.
+    // A block that fails its checksum reads as all zeroes, so nothing
+    // follows pointers out of a damaged one.
+    if(journal_read(blocknum, buf->data)) return buf;
+    const char *p = disk_block_ptr(blocknum);
+    if(!p){
+        disk_read(blocknum, buf->data);
+        p = buf->data;
+    }
+    if(csum_check(blocknum, 1, p)) return (const union fs_block *)p;
+    memset(buf->data, 0, sizeof(buf->data));
+    return buf;
+}
+
+static int block_read( int blocknum, char *data ){
+
+    // Read a data block, returning 0 if it fails its checksum
+    disk_read(blocknum, data);
+    return csum_check(blocknum, 1, data) == 1;
+}
+
+static void block_write( int blocknum, const char *data ){
+    csum_update(blocknum, 1, data);
+    disk_write(blocknum, data);
+}
+
+static int read_check( struct read_run *runs, int nruns, const char *base, int limit ){
+
+    // Check runs that have landed; returns limit, or the offset from base
+    // of the first bad block if that comes sooner
+    for(int i = 0; i < nruns; i++){
+        int good = csum_check(runs[i].blocknum, runs[i].count, runs[i].data);
+        if(good == runs[i].count) continue;
+        int bad = runs[i].data - base + good * DISK_BLOCK_SIZE;
+        return bad < limit ? bad : limit;
+    }
+    return limit;
+}
+
+static struct fs_inode *inode_lookup( int inumber ){
+
+    // Returns the resident copy of a valid inode, or NULL
+    if(inumber <= 0 || inumber >= SUPER.ninodes) return 0;
+    struct fs_inode *inode = &INODE_TABLE[inumber];
+    return inode->isvalid ? inode : 0;
+}
+
+static int inodes_per_block( int version ){
+    return version >= FS_VERSION_WIDE ? INODES_PER_BLOCK : INODES_PER_BLOCK_V1;
+}
+
+static void inodes_decode( int version, const union fs_block *block, struct fs_inode *inodes ){
+
+    // Unpack one inode block of the given format into resident inodes
+    if(version >= FS_VERSION_WIDE){
+        memcpy(inodes, block->inode, sizeof(block->inode));
+        return;
+    }
+    for(int j = 0; j < INODES_PER_BLOCK_V1; j++){
+        const struct fs_inode_v1 *old = &block->inode_v1[j];
+        memset(&inodes[j], 0, sizeof(struct fs_inode));
+        inodes[j].isvalid  = old->isvalid;
+        inodes[j].size     = old->size;
+        inodes[j].indirect = old->indirect;
+        memcpy(inodes[j].direct, old->direct, sizeof(old->direct));
+    }
+}
+
+static void inodes_encode( int version, const struct fs_inode *inodes, union fs_block *block ){
+
+    // The reverse of inodes_decode. Older formats can't hold what they
+    // have no fields for, but block_map and inline_write never let an
+    // inode on such an image use them.
+    if(version >= FS_VERSION_WIDE){
+        memcpy(block->inode, inodes, sizeof(block->inode));
+        return;
+    }
+    for(int j = 0; j < INODES_PER_BLOCK_V1; j++){
+        struct fs_inode_v1 *old = &block->inode_v1[j];
+        old->isvalid  = inodes[j].isvalid;
+        old->size     = inodes[j].size;
+        old->indirect = inodes[j].indirect;
+        memcpy(old->direct, inodes[j].direct, sizeof(old->direct));
+    }
+}
+
+static int inline_write( int inumber, struct fs_inode *inode, const char *data, int length, int64_t offset ){
+
+    // Store a write inline if the file is (or can become) inline and
+    // stays small enough. Returns -1 if it belongs in blocks, which is
+    // also where it goes when the inline data region is full.
+    if(!INLINE_TABLE || offset + length > FS_INLINE_MAX) return -1;
+    if(!(inode->flags & FS_INODE_INLINE) && inode->size > 0) return -1;
+
+    if(!(inode->flags & FS_INODE_INLINE)){
+        pthread_mutex_lock(&INODE_MAP_LOCK);
+        int slot = bitmap_alloc(&INLINE_MAP);
+        pthread_mutex_unlock(&INODE_MAP_LOCK);
+        if(slot < 0) return -1;
+        inode->inlineslot = slot;
+        memset(INLINE_TABLE[slot], 0, FS_INLINE_MAX);
+    }
+    memcpy(inline_data(inumber) + offset, data, length);
+    inode->flags |= FS_INODE_INLINE;
+    if(offset + length > inode->size) inode->size = offset + length;
+    inline_dirty(inumber);
+    return length;
+}
+
+static char *inline_data( int inumber ){
+
+    // Where an inline file's bytes are: the region slot its inode points at
+    return INLINE_TABLE[INODE_TABLE[inumber].inlineslot];
+}
+
+static void inline_dirty( int inumber ){
+    inode_dirty(inumber);
+    __atomic_store_n(&INLINE_DIRTY[INODE_TABLE[inumber].inlineslot / INLINE_PER_BLOCK], 1, __ATOMIC_RELEASE);
+}
+
+static void inline_release( int inumber ){
+
+    // The file no longer keeps its data inline. Its region slot is free
+    // to hand out again; what is left in it is never read.
+    pthread_mutex_lock(&INODE_MAP_LOCK);
+    bitmap_clear(&INLINE_MAP, INODE_TABLE[inumber].inlineslot);
+    pthread_mutex_unlock(&INODE_MAP_LOCK);
+    INODE_TABLE[inumber].inlineslot = 0;
+}
+
+static int inline_load(){
+
+    // Read the inline data region and mark the slots the inodes point at
+    int nslots = SUPER.ninlineblocks * INLINE_PER_BLOCK;
+    bitmap_destroy(&INLINE_MAP);
+    INLINE_TABLE = malloc((size_t)nslots * FS_INLINE_MAX);
+    INLINE_DIRTY = calloc(SUPER.ninlineblocks, 1);
+    if(!INLINE_TABLE || !INLINE_DIRTY || !bitmap_init(&INLINE_MAP, nslots)) return 0;
+    union fs_block *raw = malloc(sizeof(union fs_block) * SUPER.ninlineblocks);
+    if(!raw) return 0;
+    for(int i = 0; i < SUPER.ninlineblocks; i += MOUNT_BATCH_BLOCKS){
+        int count = SUPER.ninlineblocks - i;
+        if(count > MOUNT_BATCH_BLOCKS) count = MOUNT_BATCH_BLOCKS;
+        disk_submit_read(SUPER.inlinestart + i, count, raw[i].data, 0, 0);
+    }
+    disk_drain();
+    for(int i = 0; i < SUPER.ninlineblocks; i++)
+        memcpy(INLINE_TABLE + (size_t)i * INLINE_PER_BLOCK, raw[i].data, INLINE_PER_BLOCK * FS_INLINE_MAX);
+    free(raw);
+    for(int i = 1; i < SUPER.ninodes; i++){
+        struct fs_inode *inode = &INODE_TABLE[i];
+        if(!inode->isvalid || !(inode->flags & FS_INODE_INLINE)) continue;
+        if(inode->inlineslot < 0 || inode->inlineslot >= nslots || bitmap_test(&INLINE_MAP, inode->inlineslot)){
+            printf("WARNING: inode %d has a bad inline slot; its data is lost\n", i);
+            inode->flags &= ~FS_INODE_INLINE;
+            inode->size = 0;
+            inode->inlineslot = 0;
+            inode_dirty(i);
+            continue;
+        }
+        bitmap_set(&INLINE_MAP, inode->inlineslot);
+    }
+    return 1;
+}
+
+static int inline_spill( struct fs_mapping *map ){
+
+    // Move a file that has outgrown its inline slot into its first data
+    // block, after which it is an ordinary block-mapped file
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    memcpy(block.data, inline_data(map->inumber), map->inode->size);
+
+    int b = block_map(map, 0, 1, 0);
+    if(!b) return 0;
+    block_write(b, block.data);
+    inline_release(map->inumber);
+    map->inode->flags &= ~FS_INODE_INLINE;
+    return 1;
+}
+
+static void *mount_worker( void *arg ){
+
+    // Mark every block referenced by the inodes in one shard
+    struct mount_shard *shard = arg;
+    union fs_block *batch = malloc(sizeof(union fs_block) * shard->batch_size);
+    if(!batch) return 0;
+
+    // For each inode...
+    for(int i = shard->first; i <= shard->last; i++){
+
+        // Skip empty inodes
+        struct fs_inode *inode = &INODE_TABLE[i];
+        if(!inode->isvalid) continue;
+
+        // Mark each used block as such in the bitmap
+        for(int k = 0; k < POINTERS_PER_INODE; k++)
+            if(inode->direct[k] > 0 && inode->direct[k] < SUPER.nblocks)
+                bitmap_set(&shard->map, inode->direct[k]);
+
+        // Queue up the roots of the pointer trees, and scan a batch of
+        // pointer blocks whenever enough are waiting
+        mount_push(shard, inode->indirect, 1);
+        mount_push(shard, inode->dindirect, 2);
+        mount_push(shard, inode->tindirect, 3);
+        while(shard->ntodo >= shard->batch_size) mount_scan_batch(shard, batch);
+    }
+    while(shard->ntodo > 0) mount_scan_batch(shard, batch);
+    free(batch);
+    return 0;
+}
+
+static void mount_push( struct mount_shard *shard, int blocknum, int depth ){
+
+    // Mark a pointer block as used and remember to look inside it
+    if(blocknum <= 0 || blocknum >= SUPER.nblocks) return;
+    bitmap_set(&shard->map, blocknum);
+    if(shard->ntodo == shard->maxtodo){
+        int n = shard->maxtodo ? shard->maxtodo * 2 : DISK_QUEUE_DEPTH;
+        struct mount_ptr *todo = realloc(shard->todo, n * sizeof(struct mount_ptr));
+        if(!todo) return;
+        shard->todo = todo;
+        shard->maxtodo = n;
+    }
+    shard->todo[shard->ntodo].blocknum = blocknum;
+    shard->todo[shard->ntodo].depth = depth;
+    shard->ntodo++;
+}
+
+static void mount_scan_batch( struct mount_shard *shard, union fs_block *buf ){
+
+    // Read a batch of pointer blocks in parallel (or peek at them in
+    // place on a mapped disk), then mark everything they point to as
+    // used. Pointers that lead to further pointer blocks are queued.
+    struct mount_ptr batch[DISK_QUEUE_DEPTH];
+    const union fs_block *view[DISK_QUEUE_DEPTH];
+    int n = shard->ntodo < shard->batch_size ? shard->ntodo : shard->batch_size;
+    shard->ntodo -= n;
+    memcpy(batch, shard->todo + shard->ntodo, n * sizeof(struct mount_ptr));
+
+    for(int i = 0; i < n; i++){
+        view[i] = (const union fs_block *)disk_block_ptr(batch[i].blocknum);
+        if(!view[i]){
+            __atomic_add_fetch(&shard->pending, 1, __ATOMIC_RELAXED);
+            disk_submit_read(batch[i].blocknum, 1, buf[i].data, io_done, &shard->pending);
+            view[i] = &buf[i];
+        }
+    }
+    io_wait(&shard->pending);
+
+    for(int i = 0; i < n; i++){
+        for(int k = 0; k < POINTERS_PER_BLOCK; k++){
+            int b = view[i]->pointers[k];
+            if(b <= 0 || b >= SUPER.nblocks) continue;
+            if(batch[i].depth > 1) mount_push(shard, b, batch[i].depth - 1);
+            else bitmap_set(&shard->map, b);
+        }
+    }
+    shard->scanned += n;
+}
+
+static void reserve_extents( struct fs_mapping *map, int first, int last ){
+
+    // Count the blocks this write will have to allocate: every data
+    // block not yet mapped, plus the pointer blocks missing on the way to
+    // them. A new single-indirect block starts every SINGLE_SPAN blocks.
+    if(last >= max_file_blocks()) last = max_file_blocks() - 1;
+    int needed = 0;
+    for(int i = first; i <= last; i++){
+        if(!block_map(map, i, 0, 0)) needed++;
+        if(i == first || (i >= POINTERS_PER_INODE && (i - POINTERS_PER_INODE) % SINGLE_SPAN == 0))
+            needed += block_path_missing(map, i);
+    }
+    reserve_blocks(map, first, needed);
+}
+static void reserve_blocks( struct fs_mapping *map, int first, int needed ){
+
+    // Reserve needed blocks for a write starting at logical block first.
+    // Prefer to continue right after the block preceding it, so files
+    // written in chunks still end up in one run.
+    int spare = blocks_spare(map);
+    if(needed > spare) needed = spare;
+    if(needed <= 0) return;
+    map->nreserved = 0;
+    int goal = first > 0 ? block_map(map, first - 1, 0, 0) + 1 : 0;
+    if(goal > 0 && goal < SUPER.nblocks){
+        struct alloc_shard *shard = alloc_shard_of(goal);
+        pthread_mutex_lock(&shard->lock);
+        if(!bitmap_test(&G_FREE_BLOCK_BITMAP, goal)){
+            int stop = bitmap_next_set_in(&G_FREE_BLOCK_BITMAP, goal, shard->hi);
+            int length = stop - goal < needed ? stop - goal : needed;
+            bitmap_set_range(&G_FREE_BLOCK_BITMAP, goal, length);
+            map->reserved[0].start  = goal;
+            map->reserved[0].length = length;
+            map->nreserved = 1;
+            needed -= length;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // Best-fit the remainder within the home shard, taking the largest
+    // holes if no single one fits, and move on if it fills up
+    for(int i = 0; i < NALLOC_SHARDS && needed > 0 && map->nreserved < MAX_RESERVED_EXTENTS; i++){
+        struct alloc_shard *shard = &ALLOC_SHARDS[(map->inumber + i) % NALLOC_SHARDS];
+        if(shard->lo >= shard->hi) continue;
+        pthread_mutex_lock(&shard->lock);
+        while(needed > 0 && map->nreserved < MAX_RESERVED_EXTENTS){
+            int length;
+            int start = bitmap_alloc_run(&G_FREE_BLOCK_BITMAP, shard->lo, shard->hi, needed, &length);
+            if(start < 0) break;
+            map->reserved[map->nreserved].start  = start;
+            map->reserved[map->nreserved].length = length;
+            map->nreserved++;
+            needed -= length;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void release_extents( struct fs_mapping *map ){
+    for(int i = 0; i < map->nreserved; i++)
+        free_blocks(map->reserved[i].start, map->reserved[i].length);
+    map->nreserved = 0;
+}
+
+static void inode_dirty( int inumber ){
+    __atomic_store_n(&INODE_DIRTY[inumber / inodes_per_block(SUPER.version)], 1, __ATOMIC_RELEASE);
+}
+
+static void mapping_init( struct fs_mapping *map, int inumber, struct fs_inode *inode ){
+    map->inumber = inumber;
+    map->inode = inode;
+    map->nreserved = 0;
+    map->promised = 0;
+}
+
+static void mapping_commit( struct fs_mapping *map ){
+    ptrcache_flush(map->inumber);
+}
+
+static int max_file_blocks(){
+
+    // Older inodes have no room for the double and triple pointers
+    if(SUPER.version < FS_VERSION_WIDE) return POINTERS_PER_INODE + SINGLE_SPAN;
+    return POINTERS_PER_INODE + SINGLE_SPAN + DOUBLE_SPAN + TRIPLE_SPAN;
+}
+
+static int level_span( int level ){
+
+    // Logical blocks covered by each pointer in a block `level` levels
+    // above the data
+    return level == 3 ? DOUBLE_SPAN : level == 2 ? SINGLE_SPAN : 1;
+}
+
+static int *tree_root( struct fs_inode *inode, int *lblock, int *depth ){
+
+    // Find the pointer tree holding a block past the direct pointers.
+    // On return *lblock is relative to the start of that tree.
+    *lblock -= POINTERS_PER_INODE;
+    if(*lblock < SINGLE_SPAN){
+        *depth = 1;
+        return &inode->indirect;
+    }
+    *lblock -= SINGLE_SPAN;
+    if(*lblock < DOUBLE_SPAN){
+        *depth = 2;
+        return &inode->dindirect;
+    }
+    *lblock -= DOUBLE_SPAN;
+    *depth = 3;
+    return &inode->tindirect;
+}
+
+static int block_map( struct fs_mapping *map, int lblock, int allocate, int *fresh ){
+
+    // Map a file-relative block number to a disk block. Returns 0 if the
+    // block isn't allocated and allocation wasn't requested (or failed).
+    struct fs_inode *inode = map->inode;
+    if(lblock < 0 || lblock >= max_file_blocks()) return 0;
+
+    // Direct pointers live in the inode itself
+    if(lblock < POINTERS_PER_INODE){
+        if(!inode->direct[lblock] && allocate){
+            int b = next_free_block(map);
+            if(!b) return 0;
+            inode->direct[lblock] = b;
+            if(fresh) *fresh = 1;
+        }
+        return inode->direct[lblock];
+    }
+
+    // Otherwise walk down the pointer tree, creating pointer blocks as
+    // needed. Their contents come from the pointer cache, so the chain
+    // to a recently used part of a large file costs no reads at all.
+    int depth;
+    int *root = tree_root(inode, &lblock, &depth);
+    if(!*root){
+        if(!allocate) return 0;
+        int b = next_free_block(map);
+        if(!b) return 0;
+        ptrcache_fresh(map->inumber, b);
+        *root = b;
+    }
+
+    int block = *root;
+    for(int level = depth; level > 0; level--){
+        int index = lblock / level_span(level);
+        lblock %= level_span(level);
+        int next = ptrcache_get(block, index);
+        if(!next && allocate){
+            next = next_free_block(map);
+            if(!next) return 0;
+            if(level > 1) ptrcache_fresh(map->inumber, next);
+            else if(fresh) *fresh = 1;
+            ptrcache_set(map->inumber, block, index, next);
+        }
+        if(!next) return 0;
+        block = next;
+    }
+    return block;
+}
+
+static int block_path_missing( struct fs_mapping *map, int lblock ){
+
+    // How many pointer blocks block_map would have to create to reach
+    // lblock
+    if(lblock < POINTERS_PER_INODE || lblock >= max_file_blocks()) return 0;
+    int depth;
+    int *root = tree_root(map->inode, &lblock, &depth);
+    if(!*root) return depth;
+
+    int block = *root;
+    for(int level = depth; level > 1; level--){
+        int next = ptrcache_get(block, lblock / level_span(level));
+        if(!next) return level - 1;
+        lblock %= level_span(level);
+        block = next;
+    }
+    return 0;
+}
+
+static int block_set( struct fs_mapping *map, int lblock, int value ){
+
+    // Point lblock straight at value (a block, CLUSTER_COMPRESSED or 0),
+    // creating the pointer blocks on the way unless value is 0. Returns
+    // 0 if one of those couldn't be allocated.
+    struct fs_inode *inode = map->inode;
+    if(lblock < POINTERS_PER_INODE){
+        inode->direct[lblock] = value;
+        return 1;
+    }
+
+    int depth;
+    int *root = tree_root(inode, &lblock, &depth);
+    if(!*root){
+        if(!value) return 1;
+        int b = next_free_block(map);
+        if(!b) return 0;
+        ptrcache_fresh(map->inumber, b);
+        *root = b;
+    }
+
+    int block = *root;
+    for(int level = depth; level > 1; level--){
+        int index = lblock / level_span(level);
+        lblock %= level_span(level);
+        int next = ptrcache_get(block, index);
+        if(!next){
+            if(!value) return 1;
+            next = next_free_block(map);
+            if(!next) return 0;
+            ptrcache_fresh(map->inumber, next);
+            ptrcache_set(map->inumber, block, index, next);
+        }
+        block = next;
+    }
+    ptrcache_set(map->inumber, block, lblock, value);
+    return 1;
+}
+
+static int lblock_read( struct fs_mapping *map, int lblock, char *data ){
+
+    // Read one logical block of a file, whether it is a plain block, a
+    // hole or part of a compressed cluster. Returns 0 if it failed its
+    // checksum.
+    if(cluster_compressed(map, lblock)){
+        char cluster[CLUSTER_SIZE];
+        int mask;
+        int ok = cluster_load(map, lblock / CLUSTER_BLOCKS, cluster, &mask);
+        memcpy(data, cluster + (lblock % CLUSTER_BLOCKS) * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        return ok;
+    }
+    int b = block_map(map, lblock, 0, 0);
+    if(b) return block_read(b, data);
+    memset(data, 0, DISK_BLOCK_SIZE);
+    return 1;
+}
+
+static int cluster_compressed( struct fs_mapping *map, int lblock ){
+
+    // Whether lblock is part of a compressed cluster
+    if(!SUPER.compression) return 0;
+    return block_map(map, lblock - lblock % CLUSTER_BLOCKS, 0, 0) == CLUSTER_COMPRESSED;
+}
+
+static int cluster_load( struct fs_mapping *map, int cluster, char *data, int *mask ){
+
+    // Fill data with a cluster's logical contents, holes as zeroes, and
+    // set a bit in *mask for each block that holds anything. Returns 0 if
+    // the cluster is damaged; what can't be read is left zeroed.
+    int first = cluster * CLUSTER_BLOCKS;
+    int ok = 1;
+    *mask = 0;
+    if(block_map(map, first, 0, 0) != CLUSTER_COMPRESSED){
+        for(int i = 0; i < CLUSTER_BLOCKS; i++){
+            char *block = data + i * DISK_BLOCK_SIZE;
+            int b = block_map(map, first + i, 0, 0);
+            if(b <= 0){
+                memset(block, 0, DISK_BLOCK_SIZE);
+                continue;
+            }
+            *mask |= 1 << i;
+            if(!block_read(b, block)){
+                memset(block, 0, DISK_BLOCK_SIZE);
+                ok = 0;
+            }
+        }
+        return ok;
+    }
+
+    // The compressed data is in the blocks after the marker
+    char packed[CLUSTER_SIZE];
+    int n = 0;
+    for(int i = 1; i < CLUSTER_BLOCKS; i++){
+        int b = block_map(map, first + i, 0, 0);
+        if(b <= 0) break;
+        if(!block_read(b, packed + n * DISK_BLOCK_SIZE)) ok = 0;
+        n++;
+    }
+    struct cluster_header header;
+    memcpy(&header, packed, sizeof(header));
+    if(ok && (!n || header.length > n * DISK_BLOCK_SIZE - sizeof(header)
+              || lz_decompress(packed + sizeof(header), header.length, data, CLUSTER_SIZE) != CLUSTER_SIZE)){
+        printf("ERROR: Compressed cluster %d of inode %d is damaged\n", cluster, map->inumber);
+        ok = 0;
+    }
+    if(!ok){
+        memset(data, 0, CLUSTER_SIZE);
+        *mask = (1 << CLUSTER_BLOCKS) - 1;
+        return 0;
+    }
+    *mask = header.mask;
+    return 1;
+}
+
+static int cluster_store( struct fs_mapping *map, int cluster, const char *data, int mask, int dirty ){
+
+    // Write a cluster's logical contents back: compressed, if that takes
+    // fewer blocks than the ones in mask hold, and as plain blocks
+    // otherwise. Plain blocks that stay plain are rewritten in place, and
+    // only if they are in dirty; those not in mask are freed. Returns 0
+    // if it ran out of blocks.
+    int first = cluster * CLUSTER_BLOCKS;
+    int plain = __builtin_popcount(mask);
+    char packed[CLUSTER_SIZE];
+    struct cluster_header header = {0, mask};
+    int room = (plain - 1) * DISK_BLOCK_SIZE - (int)sizeof(header);
+    int n = 0;
+    if(room > 0) header.length = lz_compress(data, CLUSTER_SIZE, packed + sizeof(header), room);
+    if(header.length){
+        int bytes = sizeof(header) + header.length;
+        n = DIVIDE(bytes, DISK_BLOCK_SIZE);
+        memcpy(packed, &header, sizeof(header));
+        memset(packed + bytes, 0, n * DISK_BLOCK_SIZE - bytes);
+    }
+
+    // Whatever held the cluster before goes if either it or what
+    // replaces it is compressed
+    if(n || block_map(map, first, 0, 0) == CLUSTER_COMPRESSED) cluster_unmap(map, cluster);
+
+    if(n){
+        // The marker goes in first, so running out of blocks part way
+        // leaves a cluster that reads back as damaged, not as garbage
+        if(!block_set(map, first, CLUSTER_COMPRESSED)) return 0;
+        for(int i = 0; i < n; i++){
+            int b = block_map(map, first + 1 + i, 1, 0);
+            if(!b) return 0;
+            block_write(b, packed + i * DISK_BLOCK_SIZE);
+        }
+        return 1;
+    }
+
+    struct free_run run = {0, 0};
+    int ok = 1;
+    for(int i = 0; i < CLUSTER_BLOCKS && ok; i++){
+        int b = block_map(map, first + i, 0, 0);
+        if(!(mask & 1 << i)){
+            if(b > 0){
+                free_visit(&run, b, 0);
+                block_set(map, first + i, 0);
+            }
+            continue;
+        }
+        if(b > 0 && !(dirty & 1 << i)) continue;
+        b = block_map(map, first + i, 1, 0);
+        if(b) block_write(b, data + i * DISK_BLOCK_SIZE);
+        else ok = 0;
+    }
+    if(run.count) free_blocks(run.start, run.count);
+    return ok;
+}
+
+static void cluster_unmap( struct fs_mapping *map, int cluster ){
+
+    // Free every block of a cluster, leaving a hole. Pointer blocks stay,
+    // since the cluster is about to be stored again.
+    struct free_run run = {0, 0};
+    for(int i = 0; i < CLUSTER_BLOCKS; i++){
+        int lblock = cluster * CLUSTER_BLOCKS + i;
+        if(!block_map(map, lblock, 0, 0)) continue;
+        free_visit(&run, block_map(map, lblock, 0, 0), 0);
+        block_set(map, lblock, 0);
+    }
+    if(run.count) free_blocks(run.start, run.count);
+}
+
+static void tree_walk( int blocknum, int depth, void (*visit)( void *arg, int blocknum, int depth ), void *arg ){
+
+    // Visit every block in the pointer tree rooted at blocknum, which
+    // has depth levels of pointer blocks, children before their parent.
+    // Data blocks are visited with depth 0.
+    union fs_block buf;
+    const union fs_block *block = block_view(blocknum, &buf);
+    for(int k = 0; k < POINTERS_PER_BLOCK; k++){
+        int b = block->pointers[k];
+        if(b <= 0 || b >= SUPER.nblocks) continue;
+        if(depth > 1) tree_walk(b, depth - 1, visit, arg);
+        else visit(arg, b, 0);
+    }
+    visit(arg, blocknum, depth);
+}
+
+static int metadata_rebuild(){
+
+    // Start the checksum and dedup tables over from what the files hold
+    // now. Only images without a journal come this way, and those are
+    // a few dozen blocks at most, so a block at a time is fine.
+    if(!csum_load(SUPER.csumstart, SUPER.ncsumblocks, SUPER.nblocks)) return 0;
+    if(SUPER.ndedupblocks && !dedup_load(SUPER.dedupstart, SUPER.ndedupblocks, SUPER.nblocks)) return 0;
+    csum_reset();
+    if(dedup_active()) dedup_reset();
+    for(int i = 1; i < SUPER.ninodes; i++){
+        struct fs_inode *inode = &INODE_TABLE[i];
+        if(!inode->isvalid || (inode->flags & FS_INODE_INLINE)) continue;
+        for(int k = 0; k < POINTERS_PER_INODE; k++)
+            if(inode->direct[k] > 0 && inode->direct[k] < SUPER.nblocks)
+                rebuild_visit(0, inode->direct[k], 0);
+        if(inode->indirect > 0 && inode->indirect < SUPER.nblocks)
+            tree_walk(inode->indirect, 1, rebuild_visit, 0);
+        if(inode->dindirect > 0 && inode->dindirect < SUPER.nblocks)
+            tree_walk(inode->dindirect, 2, rebuild_visit, 0);
+        if(inode->tindirect > 0 && inode->tindirect < SUPER.nblocks)
+            tree_walk(inode->tindirect, 3, rebuild_visit, 0);
+    }
+    return 1;
+}
+
+static void rebuild_visit( void *arg, int blocknum, int depth ){
+
+    // Checksum every block a file uses, and count the file pointers to
+    // each data block of a deduplicating image
+    union fs_block block;
+    disk_read(blocknum, block.data);
+    csum_update(blocknum, 1, block.data);
+    if(depth > 0 || !dedup_active()) return;
+    uint64_t hash = blockhash(block.data, DISK_BLOCK_SIZE);
+    if(!dedup_share(blocknum, hash)) dedup_record(blocknum, hash);
+}
+
+static void free_visit( void *arg, int blocknum, int depth ){
+
+    // Free blocks for fs_delete, a run at a time
+    struct free_run *run = arg;
+    if(blocknum <= 0 || blocknum >= SUPER.nblocks) return;
+    // A data block other files still point at stays where it is
+    if(depth == 0 && !dedup_release(blocknum)) return;
+    if(depth > 0){
+        ptrcache_drop(blocknum);
+        journal_forget(blocknum);
+    }
+    if(run->count && blocknum == run->start + run->count){
+        run->count++;
+        return;
+    }
+    if(run->count) free_blocks(run->start, run->count);
+    run->start = blocknum;
+    run->count = 1;
+}
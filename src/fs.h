@@ -1,15 +1,73 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+#define FS_ALLOC_NEXTFIT 0
+#define FS_ALLOC_EXTENT  1
+
+// How fs_format sets an image up to store file data
+#define FS_COMPRESS_NONE 0
+#define FS_COMPRESS_LZ   1
+
+// Calls counted by fs_stats
+#define FS_OP_CREATE 0
+#define FS_OP_READ   1
+#define FS_OP_WRITE  2
+#define FS_OP_DELETE 3
+#define FS_OP_MOUNT  4
+#define FS_NOPS      5
+
+// Latency histogram: bucket b counts calls that took less than 2^b
+// microseconds but at least half that; the last takes anything slower
+#define FS_STATS_BUCKETS 32
+
+struct fs_op_stats {
+    long long calls;
+    long long errors;
+    long long total_ns;
+    long long max_ns;
+    long long disk_reads;       // blocks the calls asked of the disk layer
+    long long disk_writes;
+    long long histogram[FS_STATS_BUCKETS];
+};
+
+struct fs_stats {
+    struct fs_op_stats ops[FS_NOPS];
+    long long logical_read_bytes;   // returned by fs_read
+    long long logical_write_bytes;  // accepted by fs_write
+    long long physical_read_bytes;  // moved to and from the disk itself
+    long long physical_write_bytes;
+};
+
 void fs_debug();
 int  fs_format();
 int  fs_mount();
+void fs_sync();
+void fs_unmount();
+void fs_set_alloc_mode( int mode );
+void fs_set_compression( int mode );
+void fs_set_dedup( int on );
+void fs_set_mount_threads( int n );
+void fs_set_delalloc( int on );
+void fs_set_verify( int on );
+void fs_set_verbose( int on );
 
 int  fs_create();
+int  fs_create_n( int count, int *inumbers );
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+int64_t fs_getblocks( int inumber );
+
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+int  fs_punch_hole( int inumber, int64_t offset, int64_t length );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+void fs_stats( struct fs_stats *stats );
+void fs_stats_reset();
+void fs_stats_json( const struct fs_stats *stats, FILE *out );
+double fs_stats_percentile( const struct fs_op_stats *op, double p );
+const char *fs_op_name( int op );
 
 #endif
@@ -0,0 +1,433 @@
+
+#include "journal.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// On-disk layout of a transaction, written from the start of the
+// journal region: a descriptor block listing where the next (up to)
+// DESC_ENTRIES blocks belong, those blocks, further descriptors and
+// blocks as needed, then a commit block. Only the most recent
+// transaction is ever in the journal.
+#define JOURNAL_DESC_MAGIC   0x4a444553
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54
+#define DESC_ENTRIES ((DISK_BLOCK_SIZE - 4 * (int)sizeof(int)) / (int)sizeof(int))
+
+#define TXN_BUCKETS 1024
+
+struct journal_desc {
+    unsigned magic;
+    unsigned seq;
+    int count;              // blocks described here
+    int total;              // blocks in the whole transaction
+    int blocknums[DESC_ENTRIES];
+};
+
+struct journal_commit {
+    unsigned magic;
+    unsigned seq;
+    int total;
+    unsigned checksum;      // over every logged block, in order
+};
+
+union journal_block {
+    struct journal_desc desc;
+    struct journal_commit commit;
+    char data[DISK_BLOCK_SIZE];
+};
+
+// The blocks of one transaction in memory, hashed by block number
+struct txn {
+    int count;              // blocks logged
+    int credits;            // space promised to running operations
+    int max;                // room in the arrays below
+    int *blocknums;
+    int *next;              // hash chains
+    char *revoked;          // freed since being logged
+    char *images;
+    int buckets[TXN_BUCKETS];
+};
+
+int J_ACTIVE = 0;
+int J_START = 0;
+int J_BLOCKS = 0;
+int J_CAPACITY = 0;
+unsigned J_SEQ = 0;
+journal_snapshot J_SNAPSHOT = 0;
+
+struct txn TXNS[2];
+struct txn *RUNNING = 0;        // gathering changes
+struct txn *COMMITTING = 0;     // on its way to disk, or 0
+
+// J_LOCK guards the transactions' contents. Operations hold J_HANDLES
+// shared; a commit holds it exclusively while it takes its snapshot, so
+// it never sees an operation half done. J_COMMIT allows one commit at
+// a time.
+pthread_mutex_t J_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t J_HANDLES;
+pthread_mutex_t J_COMMIT = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t J_WAKE = PTHREAD_COND_INITIALIZER;
+pthread_t J_THREAD;
+int J_STOP = 0;
+
+static void *journal_main( void *arg );
+
+static unsigned checksum( unsigned sum, const char *data, int length ){
+
+    // FNV-1a, carried across calls
+    for(int i = 0; i < length; i++){
+        sum ^= (unsigned char)data[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+static void txn_reset( struct txn *t ){
+    t->count = 0;
+    t->credits = 0;
+    for(int i = 0; i < TXN_BUCKETS; i++) t->buckets[i] = -1;
+}
+
+static void txn_free( struct txn *t ){
+    free(t->blocknums);
+    free(t->next);
+    free(t->revoked);
+    free(t->images);
+    memset(t, 0, sizeof(*t));
+}
+
+static int txn_find( const struct txn *t, int blocknum ){
+    for(int i = t->buckets[blocknum % TXN_BUCKETS]; i >= 0; i = t->next[i])
+        if(t->blocknums[i] == blocknum) return i;
+    return -1;
+}
+
+static void txn_log( struct txn *t, int blocknum, const char *data ){
+
+    // Caller holds J_LOCK. A block logged twice keeps only its latest
+    // contents.
+    int i = txn_find(t, blocknum);
+    if(i < 0){
+        if(t->count == t->max){
+            int n = t->max ? t->max * 2 : 64;
+            int *blocknums = realloc(t->blocknums, n * sizeof(int));
+            if(blocknums) t->blocknums = blocknums;
+            int *next = realloc(t->next, n * sizeof(int));
+            if(next) t->next = next;
+            char *revoked = realloc(t->revoked, n);
+            if(revoked) t->revoked = revoked;
+            char *images = realloc(t->images, (size_t)n * DISK_BLOCK_SIZE);
+            if(images) t->images = images;
+            if(!blocknums || !next || !revoked || !images){
+                printf("ERROR: out of memory for the journal\n");
+                abort();
+            }
+            t->max = n;
+        }
+        i = t->count++;
+        t->blocknums[i] = blocknum;
+        t->next[i] = t->buckets[blocknum % TXN_BUCKETS];
+        t->buckets[blocknum % TXN_BUCKETS] = i;
+    }
+    t->revoked[i] = 0;
+    memcpy(t->images + (size_t)i * DISK_BLOCK_SIZE, data, DISK_BLOCK_SIZE);
+}
+
+static int txn_layout( int total ){
+    // Journal blocks taken by a transaction of total blocks
+    return total + (total + DESC_ENTRIES - 1) / DESC_ENTRIES + 1;
+}
+
+int journal_replay( int start, int nblocks, unsigned *seq ){
+
+    // Put the last committed transaction (if any) back in place. Only
+    // the journal region is read, however large the disk. Returns the
+    // number of blocks replayed, or -1 if a transaction was there but
+    // incomplete, which just means it never committed.
+    union journal_block head;
+    disk_read(start, head.data);
+    *seq = 0;
+    if(head.desc.magic != JOURNAL_DESC_MAGIC) return 0;
+    *seq = head.desc.seq;
+
+    int total = head.desc.total;
+    if(total <= 0 || txn_layout(total) > nblocks) return -1;
+    int length = txn_layout(total);
+    union journal_block *log = malloc((size_t)length * DISK_BLOCK_SIZE);
+    if(!log) return -1;
+    disk_read_blocks(start, length, log[0].data);
+
+    // Check every descriptor and the commit block before touching
+    // anything
+    int ok = 1;
+    unsigned sum = 2166136261u;
+    for(int pos = 0, done = 0; ok && done < total; ){
+        struct journal_desc *d = &log[pos].desc;
+        ok = d->magic == JOURNAL_DESC_MAGIC && d->seq == *seq
+             && d->count > 0 && d->count <= DESC_ENTRIES && d->count <= total - done;
+        if(!ok) break;
+        sum = checksum(sum, log[pos + 1].data, d->count * DISK_BLOCK_SIZE);
+        done += d->count;
+        pos += 1 + d->count;
+    }
+    struct journal_commit *c = &log[length - 1].commit;
+    ok = ok && c->magic == JOURNAL_COMMIT_MAGIC && c->seq == *seq
+         && c->total == total && c->checksum == sum;
+
+    if(ok){
+        for(int pos = 0; pos < length - 1; pos += 1 + log[pos].desc.count)
+            for(int i = 0; i < log[pos].desc.count; i++)
+                disk_write(log[pos].desc.blocknums[i], log[pos + 1 + i].data);
+        disk_sync();
+    }
+    free(log);
+    return ok ? total : -1;
+}
+
+int journal_open( int start, int nblocks, unsigned seq, journal_snapshot snapshot ){
+
+    // Start journaling into the given region. Transactions continue the
+    // sequence after seq.
+    J_START = start;
+    J_BLOCKS = nblocks;
+    J_CAPACITY = nblocks - 2 - nblocks / DESC_ENTRIES;
+    J_SEQ = seq + 1;
+    J_SNAPSHOT = snapshot;
+    if(J_CAPACITY < 1) return 0;
+
+    // Commits must not wait behind an endless stream of operations
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&J_HANDLES, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    txn_reset(&TXNS[0]);
+    txn_reset(&TXNS[1]);
+    RUNNING = &TXNS[0];
+    COMMITTING = 0;
+    J_STOP = 0;
+    J_ACTIVE = 1;
+    if(pthread_create(&J_THREAD, 0, journal_main, 0)){
+        J_ACTIVE = 0;
+        return 0;
+    }
+    return 1;
+}
+
+unsigned journal_close(){
+
+    // Commit whatever is left, then stop. The journal head is cleared
+    // so the next mount has nothing to replay. Returns the sequence
+    // number of the last transaction, for the next journal_open.
+    if(!J_ACTIVE) return J_SEQ - 1;
+    pthread_mutex_lock(&J_LOCK);
+    J_STOP = 1;
+    pthread_cond_signal(&J_WAKE);
+    pthread_mutex_unlock(&J_LOCK);
+    pthread_join(J_THREAD, 0);
+
+    journal_commit();
+    union journal_block head;
+    memset(head.data, 0, sizeof(head.data));
+    disk_write(J_START, head.data);
+    disk_sync();
+
+    J_ACTIVE = 0;
+    txn_free(&TXNS[0]);
+    txn_free(&TXNS[1]);
+    RUNNING = COMMITTING = 0;
+    pthread_rwlock_destroy(&J_HANDLES);
+    return J_SEQ - 1;
+}
+
+int journal_size( int nblocks ){
+    // Journal region needed to commit nblocks changed blocks at once
+    return txn_layout(nblocks);
+}
+
+int journal_active(){
+    return J_ACTIVE;
+}
+
+void journal_begin( int credits ){
+
+    // Join the running transaction, promising to log no more than
+    // credits blocks. If it can't take that many, commit it first.
+    if(!J_ACTIVE) return;
+    if(credits > J_CAPACITY) credits = J_CAPACITY;
+    while(1){
+        pthread_rwlock_rdlock(&J_HANDLES);
+        pthread_mutex_lock(&J_LOCK);
+        if(RUNNING->credits + credits <= J_CAPACITY){
+            RUNNING->credits += credits;
+            if(RUNNING->credits > J_CAPACITY / 2) pthread_cond_signal(&J_WAKE);
+            pthread_mutex_unlock(&J_LOCK);
+            return;
+        }
+        pthread_mutex_unlock(&J_LOCK);
+        pthread_rwlock_unlock(&J_HANDLES);
+        journal_commit();
+    }
+}
+
+void journal_end(){
+    if(J_ACTIVE) pthread_rwlock_unlock(&J_HANDLES);
+}
+
+void journal_write( int blocknum, const char *data ){
+
+    // A metadata block write: logged while journaling, else written home
+    if(!J_ACTIVE){
+        disk_write(blocknum, data);
+        return;
+    }
+    pthread_mutex_lock(&J_LOCK);
+    txn_log(RUNNING, blocknum, data);
+    pthread_mutex_unlock(&J_LOCK);
+}
+
+int journal_read( int blocknum, char *data ){
+
+    // Copy out the latest logged contents of a block that may not have
+    // reached its home location yet. Returns 0 if the journal has none.
+    if(!J_ACTIVE) return 0;
+    pthread_mutex_lock(&J_LOCK);
+    struct txn *txns[2] = {RUNNING, COMMITTING};
+    for(int k = 0; k < 2; k++){
+        if(!txns[k]) continue;
+        int i = txn_find(txns[k], blocknum);
+        if(i < 0 || txns[k]->revoked[i]) continue;
+        memcpy(data, txns[k]->images + (size_t)i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        pthread_mutex_unlock(&J_LOCK);
+        return 1;
+    }
+    pthread_mutex_unlock(&J_LOCK);
+    return 0;
+}
+
+void journal_forget( int blocknum ){
+
+    // The block was freed and may soon hold file data, so no logged copy
+    // of it may be written home or into the journal
+    if(!J_ACTIVE) return;
+    pthread_mutex_lock(&J_LOCK);
+    struct txn *txns[2] = {RUNNING, COMMITTING};
+    for(int k = 0; k < 2; k++){
+        if(!txns[k]) continue;
+        int i = txn_find(txns[k], blocknum);
+        if(i >= 0) txns[k]->revoked[i] = 1;
+    }
+    pthread_mutex_unlock(&J_LOCK);
+}
+
+void journal_commit(){
+
+    if(!J_ACTIVE) return;
+    pthread_mutex_lock(&J_COMMIT);
+
+    // Wait for running operations to finish, have the filesystem log
+    // its resident metadata, and start a new transaction for whoever
+    // comes next
+    pthread_rwlock_wrlock(&J_HANDLES);
+    if(J_SNAPSHOT) J_SNAPSHOT();
+    pthread_mutex_lock(&J_LOCK);
+    struct txn *t = RUNNING;
+    RUNNING = t == &TXNS[0] ? &TXNS[1] : &TXNS[0];
+    COMMITTING = t;
+    pthread_mutex_unlock(&J_LOCK);
+    pthread_rwlock_unlock(&J_HANDLES);
+
+    // Build the journal image, leaving out anything freed since it was
+    // logged
+    pthread_mutex_lock(&J_LOCK);
+    int total = 0;
+    for(int i = 0; i < t->count; i++) total += !t->revoked[i];
+    union journal_block *log = 0;
+    if(total && txn_layout(total) <= J_BLOCKS)
+        log = malloc((size_t)txn_layout(total) * DISK_BLOCK_SIZE);
+    if(log){
+        int pos = 0;
+        unsigned sum = 2166136261u;
+        struct journal_desc *d = 0;
+        for(int i = 0; i < t->count; i++){
+            if(t->revoked[i]) continue;
+            if(!d || d->count == DESC_ENTRIES){
+                d = &log[pos++].desc;
+                memset(d, 0, sizeof(*d));
+                d->magic = JOURNAL_DESC_MAGIC;
+                d->seq = J_SEQ;
+                d->total = total;
+            }
+            d->blocknums[d->count++] = t->blocknums[i];
+            memcpy(log[pos++].data, t->images + (size_t)i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            sum = checksum(sum, log[pos - 1].data, DISK_BLOCK_SIZE);
+        }
+        struct journal_commit *c = &log[pos].commit;
+        memset(log[pos].data, 0, DISK_BLOCK_SIZE);
+        c->magic = JOURNAL_COMMIT_MAGIC;
+        c->seq = J_SEQ;
+        c->total = total;
+        c->checksum = sum;
+    }
+    pthread_mutex_unlock(&J_LOCK);
+
+    if(log){
+        // The previous transaction's blocks must be home for good before
+        // its copy in the journal is overwritten, and the file data this
+        // one points at must be on disk before it commits. One flush
+        // covers both; a second makes the commit itself durable.
+        disk_sync();
+        disk_write_blocks(J_START, txn_layout(total), log[0].data);
+        disk_sync();
+        J_SEQ++;
+        free(log);
+    } else if(total){
+        // Operations only ever promise a bounded number of blocks, but
+        // if one outgrew the journal anyway, its blocks go straight home
+        // and the commit is not atomic, though still durable
+        printf("WARNING: %d-block transaction doesn't fit the journal; writing it in place\n", total);
+        disk_sync();
+    }
+
+    // Now the blocks can go home
+    for(int i = 0; i < t->count; i++){
+        pthread_mutex_lock(&J_LOCK);
+        if(!t->revoked[i]) disk_write(t->blocknums[i], t->images + (size_t)i * DISK_BLOCK_SIZE);
+        pthread_mutex_unlock(&J_LOCK);
+    }
+    if(!log && total) disk_sync();
+
+    pthread_mutex_lock(&J_LOCK);
+    COMMITTING = 0;
+    txn_reset(t);
+    pthread_mutex_unlock(&J_LOCK);
+    pthread_mutex_unlock(&J_COMMIT);
+}
+
+static void *journal_main( void *arg ){
+
+    // Commit every JOURNAL_COMMIT_MS, or sooner if the running
+    // transaction is filling up
+    pthread_mutex_lock(&J_LOCK);
+    while(!J_STOP){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&J_WAKE, &J_LOCK, &deadline);
+        if(J_STOP) break;
+
+        int busy = RUNNING->credits > 0;
+        pthread_mutex_unlock(&J_LOCK);
+        if(busy) journal_commit();
+        pthread_mutex_lock(&J_LOCK);
+    }
+    pthread_mutex_unlock(&J_LOCK);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// Metadata write-ahead journal. fs.c brackets every change to metadata
+// with journal_begin/journal_end and sends metadata block writes through
+// journal_write. Changes from many operations are gathered into one
+// transaction, which a background thread commits every
+// JOURNAL_COMMIT_MS: the blocks are written to the journal region with
+// one flush, and only then to their home locations.
+
+#define JOURNAL_COMMIT_MS 20
+
+// Called with no operation in progress to log whatever metadata the
+// filesystem keeps resident (inode blocks, the free map)
+typedef void (*journal_snapshot)( void );
+
+int  journal_replay( int start, int nblocks, unsigned *seq );
+int  journal_open( int start, int nblocks, unsigned seq, journal_snapshot snapshot );
+unsigned journal_close();
+int  journal_active();
+int  journal_size( int nblocks );
+
+void journal_begin( int credits );
+void journal_end();
+
+void journal_write( int blocknum, const char *data );
+int  journal_read( int blocknum, char *data );
+void journal_forget( int blocknum );
+void journal_commit();
+
+#endif
@@ -0,0 +1,137 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS  12
+#define MAX_OFFSET 65535
+
+// Sequence token: literal run length in the high nibble, match length
+// (less LZ_MIN_MATCH) in the low one. A nibble of 15 is continued by
+// bytes that are added on, up to and including the first below 255.
+#define RUN_MASK 15
+
+static uint32_t read32( const unsigned char *p ){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned hash4( uint32_t v ){
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length( unsigned char *op, int n ){
+    for(; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+int lz_compress( const char *source, int length, char *dest, int capacity ){
+
+    // Greedy parse with a single-entry hash of the next four bytes.
+    // Returns the compressed length, or 0 if it won't fit in capacity.
+    const unsigned char *src = (const unsigned char *)source;
+    const unsigned char *ip = src, *anchor = src, *end = src + length;
+    unsigned char *op = (unsigned char *)dest, *oend = op + capacity;
+    int table[1 << HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    while(end - ip >= LZ_MIN_MATCH){
+        uint32_t seq = read32(ip);
+        unsigned h = hash4(seq);
+        int candidate = table[h];
+        table[h] = ip - src;
+        if(candidate < 0 || ip - src - candidate > MAX_OFFSET || read32(src + candidate) != seq){
+            // Step further the longer it has been since the last match,
+            // so incompressible data goes through quickly
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // Stretch the match back into the pending literals and forward
+        // as far as it goes
+        const unsigned char *match = src + candidate;
+        while(ip > anchor && match > src && ip[-1] == match[-1]){
+            ip--;
+            match--;
+        }
+        const unsigned char *stop = ip + LZ_MIN_MATCH;
+        while(stop < end && *stop == match[stop - ip]) stop++;
+
+        int literals = ip - anchor;
+        int matched = stop - ip - LZ_MIN_MATCH;
+        if(oend - op < 1 + literals + literals / 255 + 1 + 2 + matched / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (literals < RUN_MASK ? literals : RUN_MASK) << 4;
+        if(literals >= RUN_MASK) op = put_length(op, literals - RUN_MASK);
+        memcpy(op, anchor, literals);
+        op += literals;
+        int offset = ip - match;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        *token |= matched < RUN_MASK ? matched : RUN_MASK;
+        if(matched >= RUN_MASK) op = put_length(op, matched - RUN_MASK);
+
+        ip = anchor = stop;
+    }
+
+    // The last sequence is literals only
+    int literals = end - anchor;
+    if(oend - op < 1 + literals + literals / 255 + 1) return 0;
+    unsigned char *token = op++;
+    *token = (literals < RUN_MASK ? literals : RUN_MASK) << 4;
+    if(literals >= RUN_MASK) op = put_length(op, literals - RUN_MASK);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - (unsigned char *)dest;
+}
+
+int lz_decompress( const char *source, int length, char *dest, int capacity ){
+
+    // Returns the bytes produced, or -1 if the input is malformed or
+    // would overrun capacity. Never reads or writes out of bounds.
+    const unsigned char *ip = (const unsigned char *)source, *iend = ip + length;
+    unsigned char *op = (unsigned char *)dest, *oend = op + capacity;
+
+    while(ip < iend){
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if(literals == RUN_MASK){
+            unsigned more;
+            do {
+                if(ip >= iend) return -1;
+                more = *ip++;
+                literals += more;
+            } while(more == 255);
+        }
+        if(literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if(ip == iend) break;
+
+        if(iend - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if(!offset || offset > (size_t)(op - (unsigned char *)dest)) return -1;
+        size_t matched = token & RUN_MASK;
+        if(matched == RUN_MASK){
+            unsigned more;
+            do {
+                if(ip >= iend) return -1;
+                more = *ip++;
+                matched += more;
+            } while(more == 255);
+        }
+        matched += LZ_MIN_MATCH;
+        if(matched > (size_t)(oend - op)) return -1;
+
+        // An overlapping match repeats the bytes it has just written
+        const unsigned char *from = op - offset;
+        if(offset >= matched) memcpy(op, from, matched);
+        else for(size_t i = 0; i < matched; i++) op[i] = from[i];
+        op += matched;
+    }
+    return op - (unsigned char *)dest;
+}
@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+// A small LZ77 codec in the style of LZ4's block format: each sequence
+// is a token, a run of literal bytes, then a back reference of at least
+// LZ_MIN_MATCH bytes within the last 64 KiB. Fast enough to sit on every
+// cluster fs.c reads and writes, at the cost of some ratio.
+
+#define LZ_MIN_MATCH 4
+
+int lz_compress( const char *source, int length, char *dest, int capacity );
+int lz_decompress( const char *source, int length, char *dest, int capacity );
+
+#endif
@@ -0,0 +1,224 @@
+#include "pagebuf.h"
+#include "disk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct pb_file {
+    int64_t size;           // file size once the pages are written
+    int npages;
+    int maxpages;
+    int unmapped;           // pages with no block on disk yet
+    int sorted;             // pages are in logical block order
+    int *lblocks;           // logical block of each page
+    char *data;             // the pages themselves, back to back
+    int *slots;             // open-addressed index: page number + 1
+    int nslots;
+};
+
+// One entry per inode, set while it has a buffer. Entries change with
+// both PB_LOCK and the inode's lock held, so either is enough to read.
+struct pb_file **FILES = 0;
+int NFILES = 0;
+int PB_TOTAL = 0;
+int PB_UNMAPPED = 0;
+pthread_mutex_t PB_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned slot_hash( int lblock, int nslots ){
+    return ((unsigned)lblock * 2654435761u) & (nslots - 1);
+}
+
+static void slots_build( struct pb_file *f ){
+    memset(f->slots, 0, sizeof(int) * f->nslots);
+    for(int i = 0; i < f->npages; i++){
+        unsigned h = slot_hash(f->lblocks[i], f->nslots);
+        while(f->slots[h]) h = (h + 1) & (f->nslots - 1);
+        f->slots[h] = i + 1;
+    }
+}
+
+static void file_free( struct pb_file *f ){
+    free(f->lblocks);
+    free(f->data);
+    free(f->slots);
+    free(f);
+}
+
+int pagebuf_init( int ninodes ){
+    pagebuf_shutdown();
+    FILES = calloc(ninodes, sizeof(struct pb_file *));
+    NFILES = FILES ? ninodes : 0;
+    return FILES != 0;
+}
+
+void pagebuf_shutdown(){
+
+    // Drops whatever is still held, unwritten
+    pthread_mutex_lock(&PB_LOCK);
+    for(int i = 0; i < NFILES; i++)
+        if(FILES[i]) file_free(FILES[i]);
+    free(FILES);
+    FILES = 0;
+    NFILES = 0;
+    __atomic_store_n(&PB_TOTAL, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&PB_UNMAPPED, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&PB_LOCK);
+}
+
+char *pagebuf_get( int inumber, int lblock ){
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    if(!f) return 0;
+    for(unsigned h = slot_hash(lblock, f->nslots); f->slots[h]; h = (h + 1) & (f->nslots - 1)){
+        int i = f->slots[h] - 1;
+        if(f->lblocks[i] == lblock) return f->data + (size_t)i * DISK_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+int pagebuf_reserve( int inumber, int count, int64_t size ){
+
+    // Make room for count more pages, starting a buffer for a file of
+    // the given size if there isn't one. Returns 0 if out of memory.
+    if(inumber >= NFILES) return 0;
+    struct pb_file *f = FILES[inumber];
+    if(!f){
+        f = calloc(1, sizeof(struct pb_file));
+        if(!f) return 0;
+        f->size = size;
+        f->sorted = 1;
+        pthread_mutex_lock(&PB_LOCK);
+        FILES[inumber] = f;
+        pthread_mutex_unlock(&PB_LOCK);
+    }
+    if(f->npages + count <= f->maxpages) return 1;
+
+    int maxpages = f->maxpages ? f->maxpages * 2 : 16;
+    if(maxpages < f->npages + count) maxpages = f->npages + count;
+    int nslots = 32;
+    while(nslots < maxpages * 2) nslots *= 2;
+    int *lblocks = realloc(f->lblocks, sizeof(int) * maxpages);
+    if(lblocks) f->lblocks = lblocks;
+    char *data = realloc(f->data, (size_t)maxpages * DISK_BLOCK_SIZE);
+    if(data) f->data = data;
+    int *slots = nslots > f->nslots ? malloc(sizeof(int) * nslots) : 0;
+    if(!lblocks || !data || (nslots > f->nslots && !slots)) return 0;
+    f->maxpages = maxpages;
+    if(slots){
+        free(f->slots);
+        f->slots = slots;
+        f->nslots = nslots;
+        slots_build(f);
+    }
+    return 1;
+}
+
+char *pagebuf_add( int inumber, int lblock, int unmapped ){
+
+    // Add a page for lblock, which must not be held already, to a buffer
+    // with room reserved for it. Its contents are up to the caller.
+    struct pb_file *f = FILES[inumber];
+    int i = f->npages++;
+    f->lblocks[i] = lblock;
+    if(i > 0 && f->lblocks[i - 1] > lblock) f->sorted = 0;
+    unsigned h = slot_hash(lblock, f->nslots);
+    while(f->slots[h]) h = (h + 1) & (f->nslots - 1);
+    f->slots[h] = i + 1;
+
+    __atomic_add_fetch(&PB_TOTAL, 1, __ATOMIC_RELAXED);
+    if(unmapped){
+        f->unmapped++;
+        __atomic_add_fetch(&PB_UNMAPPED, 1, __ATOMIC_RELAXED);
+    }
+    return f->data + (size_t)i * DISK_BLOCK_SIZE;
+}
+
+struct pb_order {
+    int lblock;
+    int page;
+};
+
+static int by_lblock( const void *a, const void *b ){
+    int x = ((const struct pb_order *)a)->lblock, y = ((const struct pb_order *)b)->lblock;
+    return x < y ? -1 : x > y;
+}
+
+int pagebuf_sorted( int inumber, const int **lblocks, char **pages ){
+
+    // Put the pages in logical block order, so runs of them can go to
+    // the disk in one request, and return how many there are
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    if(!f) return 0;
+    if(!f->sorted){
+        struct pb_order *order = malloc(sizeof(struct pb_order) * f->npages);
+        char *data = malloc((size_t)f->maxpages * DISK_BLOCK_SIZE);
+        if(order && data){
+            for(int i = 0; i < f->npages; i++){
+                order[i].lblock = f->lblocks[i];
+                order[i].page = i;
+            }
+            qsort(order, f->npages, sizeof(struct pb_order), by_lblock);
+            for(int i = 0; i < f->npages; i++){
+                f->lblocks[i] = order[i].lblock;
+                memcpy(data + (size_t)i * DISK_BLOCK_SIZE, f->data + (size_t)order[i].page * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            }
+            free(f->data);
+            f->data = data;
+            f->sorted = 1;
+            slots_build(f);
+            data = 0;
+        }
+        free(order);
+        free(data);
+    }
+    *lblocks = f->lblocks;
+    *pages = f->data;
+    return f->npages;
+}
+
+void pagebuf_drop( int inumber ){
+
+    // Forget the file's buffer, written or not
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    if(!f) return;
+    pthread_mutex_lock(&PB_LOCK);
+    FILES[inumber] = 0;
+    pthread_mutex_unlock(&PB_LOCK);
+    __atomic_sub_fetch(&PB_TOTAL, f->npages, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&PB_UNMAPPED, f->unmapped, __ATOMIC_RELAXED);
+    file_free(f);
+}
+
+int64_t pagebuf_size( int inumber ){
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    return f ? f->size : -1;
+}
+
+void pagebuf_set_size( int inumber, int64_t size ){
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    if(f) f->size = size;
+}
+
+int pagebuf_count( int inumber ){
+    struct pb_file *f = inumber < NFILES ? FILES[inumber] : 0;
+    return f ? f->npages : 0;
+}
+
+int pagebuf_total(){
+    return __atomic_load_n(&PB_TOTAL, __ATOMIC_RELAXED);
+}
+
+int pagebuf_unmapped(){
+    return __atomic_load_n(&PB_UNMAPPED, __ATOMIC_RELAXED);
+}
+
+int pagebuf_files( int *inumbers, int max ){
+
+    // List up to max inodes that have a buffer
+    int n = 0;
+    pthread_mutex_lock(&PB_LOCK);
+    for(int i = 0; i < NFILES && n < max; i++)
+        if(FILES[i]) inumbers[n++] = i;
+    pthread_mutex_unlock(&PB_LOCK);
+    return n;
+}
@@ -0,0 +1,32 @@
+#ifndef PAGEBUF_H
+#define PAGEBUF_H
+
+#include <stdint.h>
+
+// Writes held in memory until fs.c gives them blocks. Each inode has its
+// own buffer of whole blocks, keyed by logical block, plus the size the
+// file will have once they are written. Nothing here touches the disk;
+// fs.c decides when a buffer is flushed and lays it out in one go.
+// Callers hold the inode's lock, shared for lookups and exclusive for
+// anything that changes its buffer.
+
+#define PAGEBUF_MAX      16384  // blocks held for all files together
+#define PAGEBUF_FILE_MAX 4096   // blocks held for any one file
+
+int  pagebuf_init( int ninodes );
+void pagebuf_shutdown();
+
+char *pagebuf_get( int inumber, int lblock );
+int  pagebuf_reserve( int inumber, int count, int64_t size );
+char *pagebuf_add( int inumber, int lblock, int unmapped );
+int  pagebuf_sorted( int inumber, const int **lblocks, char **pages );
+void pagebuf_drop( int inumber );
+
+int64_t pagebuf_size( int inumber );
+void pagebuf_set_size( int inumber, int64_t size );
+int  pagebuf_count( int inumber );
+int  pagebuf_total();
+int  pagebuf_unmapped();
+int  pagebuf_files( int *inumbers, int max );
+
+#endif
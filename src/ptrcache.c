@@ -0,0 +1,201 @@
+
+#include "ptrcache.h"
+#include "disk.h"
+#include "journal.h"
+#include "csum.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POINTERS_PER_SLOT (DISK_BLOCK_SIZE / sizeof(int))
+
+struct ptr_slot {
+    int blocknum;           // 0 if the slot is free
+    int owner;              // inode with unwritten changes, or 0
+    unsigned long lastuse;
+    int pointers[POINTERS_PER_SLOT];
+};
+
+// The slots are split among shards by block number, each with its own
+// lock and clock, so mapping unrelated files doesn't serialize on one
+// lock or scan every slot. A shard whose slots all hold unwritten
+// changes grows rather than write one back early.
+#define SLOTS_PER_SHARD (PTRCACHE_SLOTS / PTRCACHE_SHARDS)
+
+struct ptr_shard {
+    pthread_mutex_t lock;
+    unsigned long clock;
+    struct ptr_slot *slots;
+    int nslots;
+};
+
+struct ptr_shard SHARDS[PTRCACHE_SHARDS];
+pthread_once_t SHARDS_ONCE = PTHREAD_ONCE_INIT;
+
+static void shards_init(){
+    for(int i = 0; i < PTRCACHE_SHARDS; i++){
+        pthread_mutex_init(&SHARDS[i].lock, 0);
+        SHARDS[i].slots = calloc(SLOTS_PER_SHARD, sizeof(struct ptr_slot));
+        SHARDS[i].nslots = SHARDS[i].slots ? SLOTS_PER_SHARD : 0;
+    }
+}
+
+static struct ptr_shard *shard_lock( int blocknum ){
+    pthread_once(&SHARDS_ONCE, shards_init);
+    struct ptr_shard *shard = &SHARDS[(unsigned)blocknum % PTRCACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
+static struct ptr_slot *slot_find( struct ptr_shard *shard, int blocknum ){
+    for(int i = 0; i < shard->nslots; i++)
+        if(shard->slots[i].blocknum == blocknum) return &shard->slots[i];
+    return 0;
+}
+
+static void slot_write( struct ptr_slot *s ){
+
+    // Caller holds the shard's lock
+    csum_update(s->blocknum, 1, (const char *)s->pointers);
+    journal_write(s->blocknum, (const char *)s->pointers);
+    s->owner = 0;
+}
+
+static struct ptr_slot *slot_grow( struct ptr_shard *shard ){
+
+    // Caller holds the shard's lock. Double the shard when every slot
+    // has changes; those are written and cleaned when their operations
+    // finish, so it only stays large while that many are open. Only if
+    // there is no memory for that is a changed block written back early.
+    int n = shard->nslots ? shard->nslots * 2 : SLOTS_PER_SHARD;
+    struct ptr_slot *slots = realloc(shard->slots, n * sizeof(struct ptr_slot));
+    if(!slots){
+        struct ptr_slot *s = &shard->slots[0];
+        for(int i = 1; i < shard->nslots; i++)
+            if(shard->slots[i].lastuse < s->lastuse) s = &shard->slots[i];
+        slot_write(s);
+        return s;
+    }
+    int old = shard->nslots;
+    memset(slots + old, 0, (n - old) * sizeof(struct ptr_slot));
+    shard->slots = slots;
+    shard->nslots = n;
+    return &slots[old];
+}
+
+static struct ptr_slot *slot_claim( struct ptr_shard *shard, int blocknum ){
+
+    // Caller holds the shard's lock. Recycle its least recently used
+    // slot without unwritten changes. A changed block belongs to an
+    // operation whose data may still be in flight, and writing it now
+    // could put the pointer on disk ahead of the data it points at.
+    struct ptr_slot *s = 0;
+    for(int i = 0; i < shard->nslots; i++)
+        if(!shard->slots[i].owner && (!s || shard->slots[i].lastuse < s->lastuse))
+            s = &shard->slots[i];
+    if(!s) s = slot_grow(shard);
+    s->blocknum = blocknum;
+    s->owner    = 0;
+    return s;
+}
+
+static struct ptr_slot *slot_load( struct ptr_shard *shard, int blocknum ){
+
+    // Caller holds the shard's lock
+    struct ptr_slot *s = slot_find(shard, blocknum);
+    if(!s){
+        // The journal's copy is newer than the one at home, if it has one.
+        // A block that fails its checksum is taken as empty rather than
+        // followed anywhere.
+        s = slot_claim(shard, blocknum);
+        if(!journal_read(blocknum, (char *)s->pointers)){
+            const char *p = disk_block_ptr(blocknum);
+            if(p) memcpy(s->pointers, p, DISK_BLOCK_SIZE);
+            else disk_read(blocknum, (char *)s->pointers);
+            if(!csum_check(blocknum, 1, (const char *)s->pointers))
+                memset(s->pointers, 0, sizeof(s->pointers));
+        }
+    }
+    s->lastuse = ++shard->clock;
+    return s;
+}
+
+int ptrcache_get( int blocknum, int index ){
+    struct ptr_shard *shard = shard_lock(blocknum);
+    int value = slot_load(shard, blocknum)->pointers[index];
+    pthread_mutex_unlock(&shard->lock);
+    return value;
+}
+
+void ptrcache_set( int owner, int blocknum, int index, int value ){
+    struct ptr_shard *shard = shard_lock(blocknum);
+    struct ptr_slot *s = slot_load(shard, blocknum);
+    s->pointers[index] = value;
+    s->owner = owner;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int ptrcache_empty( int blocknum ){
+
+    // Whether every pointer in the block is zero
+    struct ptr_shard *shard = shard_lock(blocknum);
+    struct ptr_slot *s = slot_load(shard, blocknum);
+    int empty = 1;
+    for(size_t i = 0; i < POINTERS_PER_SLOT && empty; i++)
+        empty = !s->pointers[i];
+    pthread_mutex_unlock(&shard->lock);
+    return empty;
+}
+
+void ptrcache_fresh( int owner, int blocknum ){
+
+    // A newly allocated pointer block starts out empty; there is no need
+    // to read whatever the disk holds there
+    struct ptr_shard *shard = shard_lock(blocknum);
+    struct ptr_slot *s = slot_find(shard, blocknum);
+    if(!s) s = slot_claim(shard, blocknum);
+    memset(s->pointers, 0, sizeof(s->pointers));
+    s->owner = owner;
+    s->lastuse = ++shard->clock;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ptrcache_flush( int owner ){
+
+    // Write back every block the inode changed, once each
+    pthread_once(&SHARDS_ONCE, shards_init);
+    for(int j = 0; j < PTRCACHE_SHARDS; j++){
+        struct ptr_shard *shard = &SHARDS[j];
+        pthread_mutex_lock(&shard->lock);
+        for(int i = 0; i < shard->nslots; i++){
+            if(!shard->slots[i].blocknum || shard->slots[i].owner != owner) continue;
+            slot_write(&shard->slots[i]);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void ptrcache_drop( int blocknum ){
+
+    // The block was freed: forget it without writing it back
+    struct ptr_shard *shard = shard_lock(blocknum);
+    struct ptr_slot *s = slot_find(shard, blocknum);
+    if(s){
+        s->blocknum = 0;
+        s->owner    = 0;
+        s->lastuse  = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ptrcache_reset(){
+    pthread_once(&SHARDS_ONCE, shards_init);
+    for(int j = 0; j < PTRCACHE_SHARDS; j++){
+        struct ptr_shard *shard = &SHARDS[j];
+        pthread_mutex_lock(&shard->lock);
+        memset(shard->slots, 0, shard->nslots * sizeof(struct ptr_slot));
+        shard->clock = 0;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
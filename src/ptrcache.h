@@ -0,0 +1,22 @@
+#ifndef PTRCACHE_H
+#define PTRCACHE_H
+
+// A small cache of indirect (pointer) blocks for fs.c's block mapping.
+// It is kept apart from the disk cache so streaming data through the
+// disk cache can't push the pointer chains of large files out of it.
+// Blocks are changed in place and belong to the inode that changed
+// them until ptrcache_flush writes them back, through the journal.
+// The slots are split among PTRCACHE_SHARDS independently locked shards.
+
+#define PTRCACHE_SLOTS  64
+#define PTRCACHE_SHARDS 8
+
+int  ptrcache_get( int blocknum, int index );
+void ptrcache_set( int owner, int blocknum, int index, int value );
+int  ptrcache_empty( int blocknum );
+void ptrcache_fresh( int owner, int blocknum );
+void ptrcache_flush( int owner );
+void ptrcache_drop( int blocknum );
+void ptrcache_reset();
+
+#endif
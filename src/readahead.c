@@ -0,0 +1,234 @@
+
+#include "readahead.h"
+#include "disk.h"
+#include "csum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define RA_IDLE    0
+#define RA_QUEUED  1
+#define RA_LOADING 2
+
+struct ra_stream {
+    int inumber;            // 0 if the slot is free
+    int64_t next_offset;    // where a sequential reader picks up next
+    int window;             // blocks fetched by the next readahead
+    int start;              // first logical block held in buf
+    int count;              // number of logical blocks held in buf
+    int loaded;             // leading blocks of buf already valid
+    int state;              // RA_IDLE, RA_QUEUED or RA_LOADING
+    unsigned long lastuse;
+    int phys[RA_MAX_WINDOW];
+    char *buf;
+};
+
+struct ra_stream STREAMS[RA_STREAMS];
+unsigned long RA_CLOCK = 0;
+
+pthread_mutex_t RA_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  RA_WORK = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  RA_DONE = PTHREAD_COND_INITIALIZER;
+pthread_t RA_THREAD;
+int RA_RUNNING = 0;
+
+static void *readahead_main( void *arg );
+
+static struct ra_stream *stream_find( int inumber ){
+    for(int i = 0; i < RA_STREAMS; i++)
+        if(STREAMS[i].inumber == inumber) return &STREAMS[i];
+    return 0;
+}
+
+static void stream_wait( struct ra_stream *s ){
+    // Caller holds RA_LOCK
+    while(s->state != RA_IDLE)
+        pthread_cond_wait(&RA_DONE, &RA_LOCK);
+}
+
+int readahead_copy( int inumber, int lblock, int boff, char *data, int length ){
+
+    // Serve part of a block from the prefetch buffer if we have it,
+    // waiting for the helper if it is still loading. Returns 1 on a hit.
+    pthread_mutex_lock(&RA_LOCK);
+    struct ra_stream *s = stream_find(inumber);
+    if(!s || lblock < s->start || lblock >= s->start + s->count){
+        pthread_mutex_unlock(&RA_LOCK);
+        return 0;
+    }
+    stream_wait(s);
+    if(s->inumber != inumber){
+        pthread_mutex_unlock(&RA_LOCK);
+        return 0;
+    }
+    memcpy(data, s->buf + (size_t)(lblock - s->start) * DISK_BLOCK_SIZE + boff, length);
+    s->lastuse = ++RA_CLOCK;
+    pthread_mutex_unlock(&RA_LOCK);
+    return 1;
+}
+
+int readahead_advance( int inumber, int64_t offset, int length ){
+
+    // Record a completed read and return how many blocks to prefetch
+    // after it: zero for random access, otherwise a window that doubles
+    // each time the reader stays sequential
+    pthread_mutex_lock(&RA_LOCK);
+    struct ra_stream *s = stream_find(inumber);
+    if(!s){
+        // Only start tracking files read from the beginning
+        if(offset != 0){
+            pthread_mutex_unlock(&RA_LOCK);
+            return 0;
+        }
+        // Recycle the least recently used slot
+        s = &STREAMS[0];
+        for(int i = 1; i < RA_STREAMS; i++)
+            if(STREAMS[i].lastuse < s->lastuse) s = &STREAMS[i];
+        stream_wait(s);
+        if(!s->buf) s->buf = malloc((size_t)RA_MAX_WINDOW * DISK_BLOCK_SIZE);
+        if(!s->buf){
+            pthread_mutex_unlock(&RA_LOCK);
+            return 0;
+        }
+        s->inumber     = inumber;
+        s->next_offset = 0;
+        s->window      = 0;
+        s->count       = 0;
+    }
+
+    if(offset == s->next_offset){
+        s->window = s->window ? s->window * 2 : RA_MIN_WINDOW;
+        if(s->window > RA_MAX_WINDOW) s->window = RA_MAX_WINDOW;
+    } else {
+        s->window = 0;
+    }
+    s->next_offset = offset + length;
+    s->lastuse = ++RA_CLOCK;
+
+    int window = s->window;
+    pthread_mutex_unlock(&RA_LOCK);
+    return window;
+}
+
+void readahead_issue( int inumber, int lblock, int count, const int *phys ){
+
+    // Queue a fetch of count logical blocks starting at lblock. A zero
+    // physical block is a hole and reads back as zeroes.
+    if(count <= 0) return;
+    if(count > RA_MAX_WINDOW) count = RA_MAX_WINDOW;
+
+    pthread_mutex_lock(&RA_LOCK);
+    struct ra_stream *s = stream_find(inumber);
+    if(!s){
+        pthread_mutex_unlock(&RA_LOCK);
+        return;
+    }
+    stream_wait(s);
+
+    // Keep whatever part of the new range we already hold by sliding it
+    // to the front of the buffer, so only the rest has to be fetched
+    int keep = 0;
+    if(lblock >= s->start && lblock < s->start + s->count){
+        keep = s->start + s->count - lblock;
+        if(keep >= count){
+            pthread_mutex_unlock(&RA_LOCK);
+            return;
+        }
+        memmove(s->buf, s->buf + (size_t)(lblock - s->start) * DISK_BLOCK_SIZE,
+                (size_t)keep * DISK_BLOCK_SIZE);
+    }
+
+    if(!RA_RUNNING){
+        if(pthread_create(&RA_THREAD, 0, readahead_main, 0)){
+            pthread_mutex_unlock(&RA_LOCK);
+            return;
+        }
+        RA_RUNNING = 1;
+    }
+
+    memcpy(s->phys, phys, count * sizeof(int));
+    s->start  = lblock;
+    s->count  = count;
+    s->loaded = keep;
+    s->state  = RA_QUEUED;
+    pthread_cond_signal(&RA_WORK);
+    pthread_mutex_unlock(&RA_LOCK);
+}
+
+void readahead_invalidate( int inumber ){
+
+    // The file changed under us: forget anything prefetched for it
+    pthread_mutex_lock(&RA_LOCK);
+    struct ra_stream *s = stream_find(inumber);
+    if(s){
+        stream_wait(s);
+        s->inumber = 0;
+        s->count   = 0;
+        s->lastuse = 0;
+    }
+    pthread_mutex_unlock(&RA_LOCK);
+}
+
+void readahead_shutdown(){
+
+    pthread_mutex_lock(&RA_LOCK);
+    for(int i = 0; i < RA_STREAMS; i++){
+        stream_wait(&STREAMS[i]);
+        free(STREAMS[i].buf);
+        memset(&STREAMS[i], 0, sizeof(STREAMS[i]));
+    }
+    int running = RA_RUNNING;
+    RA_RUNNING = 0;
+    pthread_cond_broadcast(&RA_WORK);
+    pthread_mutex_unlock(&RA_LOCK);
+
+    if(running) pthread_join(RA_THREAD, 0);
+}
+
+static void *readahead_main( void *arg ){
+
+    pthread_mutex_lock(&RA_LOCK);
+    while(1){
+
+        // Wait for a queued stream (or for shutdown)
+        struct ra_stream *s = 0;
+        while(RA_RUNNING){
+            for(int i = 0; i < RA_STREAMS && !s; i++)
+                if(STREAMS[i].state == RA_QUEUED) s = &STREAMS[i];
+            if(s) break;
+            pthread_cond_wait(&RA_WORK, &RA_LOCK);
+        }
+        if(!s) break;
+        s->state = RA_LOADING;
+        pthread_mutex_unlock(&RA_LOCK);
+
+        // Fetch physically contiguous runs with one call each. Nothing
+        // from a block that fails its checksum on is kept; fs_read will
+        // find it again and report it.
+        int count = s->count;
+        for(int i = s->loaded; i < count; ){
+            char *dst = s->buf + (size_t)i * DISK_BLOCK_SIZE;
+            if(!s->phys[i]){
+                memset(dst, 0, DISK_BLOCK_SIZE);
+                i++;
+                continue;
+            }
+            int run = 1;
+            while(i + run < count && s->phys[i + run] == s->phys[i] + run) run++;
+            disk_read_blocks(s->phys[i], run, dst);
+            int good = csum_check(s->phys[i], run, dst);
+            if(good < run) count = i + good;
+            i += run;
+        }
+
+        pthread_mutex_lock(&RA_LOCK);
+        s->count = count;
+        s->loaded = count;
+        s->state = RA_IDLE;
+        pthread_cond_broadcast(&RA_DONE);
+    }
+    pthread_mutex_unlock(&RA_LOCK);
+    return 0;
+}
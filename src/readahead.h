@@ -0,0 +1,20 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+// Sequential readahead for fs_read. fs.c decides which physical blocks
+// to fetch; a helper thread reads them into a per-inode buffer while the
+// caller is busy with the data it already has.
+
+#define RA_STREAMS     8
+#define RA_MIN_WINDOW  4
+#define RA_MAX_WINDOW  256
+
+int  readahead_copy( int inumber, int lblock, int boff, char *data, int length );
+int  readahead_advance( int inumber, int64_t offset, int length );
+void readahead_issue( int inumber, int lblock, int count, const int *phys );
+void readahead_invalidate( int inumber );
+void readahead_shutdown();
+
+#endif
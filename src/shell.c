@@ -6,224 +6,624 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+/* Bytes handed to each fs call when copying a mapped host file. */
+#define COPY_SPAN_SIZE (1024*DISK_BLOCK_SIZE)
+
+/* Bounce buffer for host files that can't be mapped. */
+#define COPY_BUFFER_SIZE (256*DISK_BLOCK_SIZE)
+
+/* Distinct command names timed in batch mode. */
+#define MAX_TIMED_COMMANDS 32
+
+/* Scripts and command strings given on the command line. */
+#define MAX_SCRIPTS 64
+
+struct timing {
+	char name[32];
+	long long count;
+	double total;
+	double min;
+	double max;
+};
+
+static int batch = 0;
+static struct timing timings[MAX_TIMED_COMMANDS];
+static int ntimings = 0;
+
+static int run_line( char *line );
+static int run_file( FILE *file );
+static int run_string( const char *text );
+static int do_command( char *line );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static void do_stats();
+static void print_timings();
 
 int main( int argc, char *argv[] )
 {
-	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	const char *scripts[MAX_SCRIPTS];
+	int inline_script[MAX_SCRIPTS];
+	int nscripts = 0;
+	FILE *file;
+	int i, opt, running;
+	int cacheframes = DISK_CACHE_FRAMES;
+	int backend = DISK_BACKEND_FILE;
+	int engine = DISK_ASYNC_AUTO;
+
+	while((opt=getopt(argc,argv,"a:c:e:f:j:m"))!=-1) {
+		switch(opt) {
+			case 'a':
+				if(!strcmp(optarg,"uring")) {
+					engine = DISK_ASYNC_URING;
+				} else if(!strcmp(optarg,"threads")) {
+					engine = DISK_ASYNC_THREADS;
+				} else if(!strcmp(optarg,"none")) {
+					engine = DISK_ASYNC_INLINE;
+				} else {
+					printf("unknown async engine: %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				cacheframes = atoi(optarg);
+				break;
+			case 'e':
+			case 'f':
+				if(nscripts==MAX_SCRIPTS) {
+					printf("too many scripts\n");
+					return 1;
+				}
+				inline_script[nscripts] = opt=='e';
+				scripts[nscripts++] = optarg;
+				break;
+			case 'j':
+				fs_set_mount_threads(atoi(optarg));
+				break;
+			case 'm':
+				backend = DISK_BACKEND_MMAP;
+				break;
+			default:
+				printf("use: %s [-m] [-a uring|threads|none] [-c cacheframes] [-j mountthreads] [-f script] [-e commands] <diskfile> <nblocks>\n",argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-m] [-a uring|threads|none] [-c cacheframes] [-j mountthreads] [-f script] [-e commands] <diskfile> <nblocks>\n",argv[0]);
+		return 1;
+	}
+
+	if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(!disk_cache_init(cacheframes)) {
+		printf("couldn't allocate a %d frame block cache\n",cacheframes);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(!disk_async_init(engine)) {
+		printf("couldn't start the async disk engine\n");
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
+
+	/*
+	Scripts run in the order given, without a prompt or the filesystem's
+	progress messages, and every command is timed. A script of "-" is
+	read from standard input.
+	*/
+	if(nscripts>0) {
+		batch = 1;
+		fs_set_verbose(0);
+		running = 1;
+		for(i=0;i<nscripts && running;i++) {
+			if(inline_script[i]) {
+				running = run_string(scripts[i]);
+				continue;
+			}
+			file = strcmp(scripts[i],"-") ? fopen(scripts[i],"r") : stdin;
+			if(!file) {
+				printf("couldn't open %s: %s\n",scripts[i],strerror(errno));
+				break;
+			}
+			running = run_file(file);
+			if(file!=stdin) fclose(file);
+		}
+		print_timings();
+	} else {
+		run_file(stdin);
+	}
+
+	fs_unmount();
+
+	printf("closing emulated disk.\n");
+	disk_close();
+
+	return 0;
+}
+
+
+/* Returns 0 once a command asks to quit. */
+
+static int run_file( FILE *file )
+{
+	char line[1024];
+	int n;
 
 	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+		if(!batch) {
+			printf(" simplefs> ");
+			fflush(stdout);
+		}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+		if(!fgets(line,sizeof(line),file)) break;
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+		n = strlen(line);
+		while(n>0 && (line[n-1]=='\n' || line[n-1]=='\r')) line[--n] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+		if(!run_line(line)) return 0;
+	}
 
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+	return 1;
+}
+
+/* Commands separated by semicolons, as given to -e. */
+
+static int run_string( const char *text )
+{
+	char line[1024];
+	const char *end;
+	int n;
+
+	while(*text) {
+		end = strchr(text,';');
+		n = end ? end-text : (int)strlen(text);
+		if(n>=(int)sizeof(line)) n = sizeof(line)-1;
+		memcpy(line,text,n);
+		line[n] = 0;
+		if(!run_line(line)) return 0;
+		if(!end) break;
+		text = end+1;
+	}
+
+	return 1;
+}
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static void record_timing( const char *name, double seconds )
+{
+	struct timing *t;
+	int i;
+
+	for(i=0;i<ntimings;i++) {
+		if(!strcmp(timings[i].name,name)) break;
+	}
+	if(i==ntimings) {
+		if(ntimings==MAX_TIMED_COMMANDS) return;
+		t = &timings[ntimings++];
+		snprintf(t->name,sizeof(t->name),"%s",name);
+		t->min = seconds;
+	}
+	t = &timings[i];
+	t->count++;
+	t->total += seconds;
+	if(seconds<t->min) t->min = seconds;
+	if(seconds>t->max) t->max = seconds;
+}
+
+/*
+Run one line: blank lines and # comments are skipped, and
+"repeat <count> <command>" runs the command count times.
+*/
+
+static int run_line( char *line )
+{
+	char cmd[1024];
+	double started;
+	int count, skip = 0, i, result;
+
+	line += strspn(line," \t");
+	if(!line[0] || line[0]=='#') return 1;
+
+	if(!strncmp(line,"repeat",6) && (line[6]==' ' || line[6]=='\t' || !line[6])) {
+		if(sscanf(line+6,"%d %n",&count,&skip)!=1 || !skip || !line[6+skip]) {
+			printf("use: repeat <count> <command>\n");
+			return 1;
+		}
+		for(i=0;i<count;i++) {
+			if(!run_line(line+6+skip)) return 0;
+		}
+		return 1;
+	}
+
+	if(!batch) return do_command(line);
+
+	sscanf(line,"%1023s",cmd);
+	started = now();
+	result = do_command(line);
+	if(result) record_timing(cmd,now()-started);
+	return result;
+}
+
+static void print_timings()
+{
+	struct timing *t;
+	int i;
+
+	if(!ntimings) return;
+	printf("%-10s %10s %12s %12s %12s %12s\n","command","count","total ms","avg us","min us","max us");
+	for(i=0;i<ntimings;i++) {
+		t = &timings[i];
+		printf("%-10s %10lld %12.3f %12.1f %12.1f %12.1f\n",
+			t->name,t->count,t->total*1e3,t->total/t->count*1e6,t->min*1e6,t->max*1e6);
+	}
+}
+
+static int do_command( char *line )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	char arg3[1024];
+	int inumber, result, args;
+	long long size;
+
+	args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		if(args==1 || (args==2 && (!strcmp(arg1,"lz") || !strcmp(arg1,"none") || !strcmp(arg1,"dedup")))) {
+			fs_set_compression(args==2 && !strcmp(arg1,"lz") ? FS_COMPRESS_LZ : FS_COMPRESS_NONE);
+			fs_set_dedup(args==2 && !strcmp(arg1,"dedup"));
+			if(fs_format()) {
+				printf("disk formatted.\n");
 			} else {
-				printf("use: format\n");
+				printf("format failed!\n");
 			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
+		} else {
+			printf("use: format [none|lz|dedup]\n");
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				printf("disk mounted.\n");
 			} else {
-				printf("use: mount\n");
+				printf("mount failed!\n");
 			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
+		} else {
+			printf("use: mount\n");
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			printf("use: debug\n");
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			size = fs_getsize(inumber);
+			if(size>=0) {
+				printf("inode %d has size %lld\n",inumber,size);
 			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
+				printf("getsize failed!\n");
+			}
+		} else {
+			printf("use: getsize <inumber>\n");
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				printf("created inode %d\n",inumber);
 			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
+				printf("create failed!\n");
+			}
+		} else if(args==2 && atoi(arg1)>0) {
+			int count = atoi(arg1);
+			int *inumbers = malloc(count*sizeof(int));
+			result = inumbers ? fs_create_n(count,inumbers) : 0;
+			if(result>0) {
+				printf("created %d inodes (%d to %d)\n",result,inumbers[0],inumbers[result-1]);
 			} else {
-				printf("use: create\n");
+				printf("create failed!\n");
 			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
+			free(inumbers);
+		} else {
+			printf("use: create [count]\n");
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(fs_delete(inumber)) {
+				printf("inode %d deleted.\n",inumber);
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("delete failed!\n");	
 			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
+		} else {
+			printf("use: delete <inumber>\n");
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(!do_copyout(inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
+			}
+		} else {
+			printf("use: cat <inumber>\n");
+		}
+
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			inumber = atoi(arg2);
+			if(do_copyin(arg1,inumber)) {
+				printf("copied file %s to inode %d\n",arg1,inumber);
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("copy failed!\n");
 			}
+		} else {
+			printf("use: copyin <filename> <inumber>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = atoi(arg1);
+			if(do_copyout(inumber,arg2)) {
+				printf("copied inode %d to file %s\n",inumber,arg2);
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("copy failed!\n");
 			}
+		} else {
+			printf("use: copyout <inumber> <filename>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"punch")) {
+		if(args==4) {
+			inumber = atoi(arg1);
+			if(fs_punch_hole(inumber,atoll(arg2),atoll(arg3))) {
+				printf("punched %s bytes at %s in inode %d\n",arg3,arg2,inumber);
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
+				printf("punch failed!\n");
+			}
 		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			printf("use: punch <inumber> <offset> <length>\n");
 		}
+
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			do_stats();
+		} else if(args==2 && !strcmp(arg1,"json")) {
+			struct fs_stats stats;
+			fs_stats(&stats);
+			fs_stats_json(&stats,stdout);
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			fs_stats_reset();
+			printf("statistics reset.\n");
+		} else {
+			printf("use: stats [json|reset]\n");
+		}
+
+	} else if(!strcmp(cmd,"help")) {
+		printf("Commands are:\n");
+		printf("    format  [none|lz|dedup]\n");
+		printf("    mount\n");
+		printf("    debug\n");
+		printf("    create  [count]\n");
+		printf("    delete  <inode>\n");
+		printf("    cat     <inode>\n");
+		printf("    copyin  <file> <inode>\n");
+		printf("    copyout <inode> <file>\n");
+		printf("    punch   <inode> <offset> <length>\n");
+		printf("    stats   [json|reset]\n");
+		printf("    repeat  <count> <command>\n");
+		printf("    help\n");
+		printf("    quit\n");
+		printf("    exit\n");
+	} else if(!strcmp(cmd,"quit")) {
+		return 0;
+	} else if(!strcmp(cmd,"exit")) {
+		return 0;
+	} else {
+		printf("unknown command: %s\n",cmd);
+		printf("type 'help' for a list of commands.\n");
 	}
 
-	printf("closing emulated disk.\n");
-	disk_close();
+	return 1;
+}
 
-	return 0;
+/*
+Copies between host files and the filesystem. A regular host file is
+mapped and handed over a span at a time, so whole blocks move between
+the host's page cache and the disk with no copy in between. Pipes and
+devices, which can't be mapped, go through an aligned bounce buffer.
+*/
+
+static long long copy_to_fs( int inumber, const char *data, long long length, long long offset )
+{
+	long long done = 0;
+	int n, actual;
+
+	while(done<length) {
+		n = length-done<COPY_SPAN_SIZE ? length-done : COPY_SPAN_SIZE;
+		actual = fs_write(inumber,data+done,n,offset+done);
+		if(actual<0) {
+			printf("ERROR: fs_write return invalid result %d\n",actual);
+			break;
+		}
+		done += actual;
+		if(actual!=n) {
+			printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,n);
+			break;
+		}
+	}
+
+	return done;
 }
 
 static int do_copyin( const char *filename, int inumber )
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	struct stat info;
+	long long offset=0, done;
+	ssize_t result;
+	char *buffer, *map;
+	int fd;
 
-	file = fopen(filename,"r");
-	if(!file) {
+	fd = open(filename,O_RDONLY);
+	if(fd<0) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
+	if(fstat(fd,&info)==0 && S_ISREG(info.st_mode) && info.st_size>0) {
+		map = mmap(0,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(map!=MAP_FAILED) {
+			madvise(map,info.st_size,MADV_SEQUENTIAL);
+			offset = copy_to_fs(inumber,map,info.st_size,0);
+			munmap(map,info.st_size);
+			close(fd);
+			if(offset<info.st_size) {
+				printf("ERROR: only %lld of %lld bytes copied\n",offset,(long long)info.st_size);
+				return 0;
 			}
+			printf("%lld bytes copied\n",offset);
+			return 1;
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	if(posix_memalign((void**)&buffer,DISK_BLOCK_SIZE,COPY_BUFFER_SIZE)) {
+		printf("couldn't allocate copy buffer\n");
+		close(fd);
+		return 0;
+	}
 
-	fclose(file);
+	while(1) {
+		result = read(fd,buffer,COPY_BUFFER_SIZE);
+		if(result<0 && errno==EINTR) continue;
+		if(result<0) {
+			printf("ERROR: couldn't read %s: %s\n",filename,strerror(errno));
+			break;
+		}
+		if(result==0) break;
+		done = copy_to_fs(inumber,buffer,result,offset);
+		offset += done;
+		if(done!=result) {
+			printf("ERROR: only %lld of %lld bytes copied\n",offset,offset-done+result);
+			break;
+		}
+	}
+
+	free(buffer);
+	close(fd);
+	if(result!=0) return 0;
+	printf("%lld bytes copied\n",offset);
 	return 1;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	struct stat info;
+	long long offset=0, size;
+	ssize_t written;
+	int fd, result, n, mapped=0;
+	char *buffer, *map;
+
+	/* Anything already printed has to come out first when this is cat. */
+	fflush(stdout);
+
+	/* fs_getsize has already said why when the inode isn't valid. */
+	size = fs_getsize(inumber);
+	if(size<0) return 0;
 
-	file = fopen(filename,"w");
-	if(!file) {
+	fd = open(filename,O_RDWR|O_CREAT|O_TRUNC,0666);
+	if(fd<0) fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	if(size>0 && fstat(fd,&info)==0 && S_ISREG(info.st_mode) && ftruncate(fd,size)==0) {
+		map = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		if(map!=MAP_FAILED) {
+			while(offset<size) {
+				n = size-offset<COPY_SPAN_SIZE ? size-offset : COPY_SPAN_SIZE;
+				result = fs_read(inumber,map+offset,n,offset);
+				if(result<=0) break;
+				offset += result;
+			}
+			munmap(map,size);
+			if(offset<size) ftruncate(fd,offset);
+			mapped = 1;
+		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	if(!mapped) {
+		if(posix_memalign((void**)&buffer,DISK_BLOCK_SIZE,COPY_BUFFER_SIZE)) {
+			printf("couldn't allocate copy buffer\n");
+			close(fd);
+			return 0;
+		}
+		while(1) {
+			result = fs_read(inumber,buffer,COPY_BUFFER_SIZE,offset);
+			if(result<=0) break;
+			for(n=0;n<result;n+=written) {
+				written = write(fd,buffer+n,result-n);
+				if(written<0 && errno==EINTR) written = 0;
+				else if(written<=0) break;
+			}
+			offset += n;
+			if(n<result) {
+				printf("ERROR: couldn't write %s: %s\n",filename,written<0 ? strerror(errno) : "short write");
+				break;
+			}
+		}
+		free(buffer);
+	}
 
-	fclose(file);
+	close(fd);
+	if(offset<size) {
+		printf("ERROR: only %lld of %lld bytes copied\n",offset,size);
+		return 0;
+	}
+	printf("%lld bytes copied\n",offset);
 	return 1;
 }
 
+static void do_stats()
+{
+	struct fs_stats stats;
+	const struct fs_op_stats *s;
+	int i;
+
+	fs_stats(&stats);
+
+	printf("%-8s %10s %8s %12s %10s %10s %10s %12s %12s\n",
+		"op","calls","errors","avg us","p50 us","p99 us","max us","disk reads","disk writes");
+	for(i=0;i<FS_NOPS;i++) {
+		s = &stats.ops[i];
+		printf("%-8s %10lld %8lld %12.1f %10.1f %10.1f %10.1f %12lld %12lld\n",
+			fs_op_name(i),s->calls,s->errors,
+			s->calls ? s->total_ns/1e3/s->calls : 0.0,
+			fs_stats_percentile(s,50),fs_stats_percentile(s,99),s->max_ns/1e3,
+			s->disk_reads,s->disk_writes);
+	}
+
+	/* Physical traffic includes what the journal and cache did on their own. */
+	printf("logical:  %lld bytes read, %lld bytes written\n",stats.logical_read_bytes,stats.logical_write_bytes);
+	printf("physical: %lld bytes read, %lld bytes written\n",stats.physical_read_bytes,stats.physical_write_bytes);
+}
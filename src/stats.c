@@ -0,0 +1,155 @@
+
+#include "stats.h"
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Counters since the last fs_stats_reset. The physical byte counts are
+// kept as the disk's totals at that point and subtracted on the way out.
+struct fs_stats STATS;
+long long BASE_READS = 0;
+long long BASE_WRITES = 0;
+
+static const char *OP_NAMES[FS_NOPS] = {"create", "read", "write", "delete", "mount"};
+
+#define ADD(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define LOAD(counter)   __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static int bucket_of( long long ns ){
+
+    // Bucket b holds calls that took less than 2^b microseconds, and at
+    // least half that
+    long long us = ns / 1000;
+    int b = 0;
+    while(us > 0 && b < FS_STATS_BUCKETS - 1){
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void stats_begin( struct stats_call *call ){
+    clock_gettime(CLOCK_MONOTONIC, &call->started);
+    disk_thread_counts(&call->reads, &call->writes);
+}
+
+void stats_end( struct stats_call *call, int op, int ok ){
+
+    struct timespec finished;
+    long long reads, writes;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    disk_thread_counts(&reads, &writes);
+    long long ns = (finished.tv_sec - call->started.tv_sec) * 1000000000LL
+                   + (finished.tv_nsec - call->started.tv_nsec);
+
+    struct fs_op_stats *s = &STATS.ops[op];
+    ADD(s->calls, 1);
+    if(!ok) ADD(s->errors, 1);
+    ADD(s->total_ns, ns);
+    ADD(s->disk_reads, reads - call->reads);
+    ADD(s->disk_writes, writes - call->writes);
+    ADD(s->histogram[bucket_of(ns)], 1);
+
+    long long max = LOAD(s->max_ns);
+    while(ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void stats_bytes( long long read, long long written ){
+    if(read > 0) ADD(STATS.logical_read_bytes, read);
+    if(written > 0) ADD(STATS.logical_write_bytes, written);
+}
+
+void fs_stats( struct fs_stats *stats ){
+
+    // A copy of the counters; each is read atomically, though the set
+    // as a whole may straddle calls in flight
+    for(int i = 0; i < FS_NOPS; i++){
+        const struct fs_op_stats *s = &STATS.ops[i];
+        struct fs_op_stats *d = &stats->ops[i];
+        d->calls = LOAD(s->calls);
+        d->errors = LOAD(s->errors);
+        d->total_ns = LOAD(s->total_ns);
+        d->max_ns = LOAD(s->max_ns);
+        d->disk_reads = LOAD(s->disk_reads);
+        d->disk_writes = LOAD(s->disk_writes);
+        for(int b = 0; b < FS_STATS_BUCKETS; b++)
+            d->histogram[b] = LOAD(s->histogram[b]);
+    }
+    stats->logical_read_bytes = LOAD(STATS.logical_read_bytes);
+    stats->logical_write_bytes = LOAD(STATS.logical_write_bytes);
+
+    long long reads, writes;
+    disk_counts(&reads, &writes);
+    stats->physical_read_bytes = (reads - BASE_READS) * DISK_BLOCK_SIZE;
+    stats->physical_write_bytes = (writes - BASE_WRITES) * DISK_BLOCK_SIZE;
+}
+
+void fs_stats_reset(){
+
+    // Calls still running when this happens may land partly on either side
+    for(int i = 0; i < FS_NOPS; i++){
+        struct fs_op_stats *s = &STATS.ops[i];
+        __atomic_store_n(&s->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->disk_reads, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->disk_writes, 0, __ATOMIC_RELAXED);
+        for(int b = 0; b < FS_STATS_BUCKETS; b++)
+            __atomic_store_n(&s->histogram[b], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&STATS.logical_read_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&STATS.logical_write_bytes, 0, __ATOMIC_RELAXED);
+    disk_counts(&BASE_READS, &BASE_WRITES);
+}
+
+const char *fs_op_name( int op ){
+    return op >= 0 && op < FS_NOPS ? OP_NAMES[op] : "unknown";
+}
+
+double fs_stats_percentile( const struct fs_op_stats *op, double p ){
+
+    // The upper edge of the bucket holding the p-th percentile call, in
+    // microseconds; never more than the slowest call actually seen
+    if(op->calls <= 0) return 0;
+    long long rank = (long long)(p / 100 * op->calls + 0.5);
+    if(rank < 1) rank = 1;
+    long long seen = 0;
+    double max_us = op->max_ns / 1e3;
+    for(int b = 0; b < FS_STATS_BUCKETS; b++){
+        seen += op->histogram[b];
+        if(seen < rank) continue;
+        double edge = (double)(1LL << b);
+        return edge < max_us ? edge : max_us;
+    }
+    return max_us;
+}
+
+void fs_stats_json( const struct fs_stats *stats, FILE *out ){
+
+    fprintf(out, "{\n  \"ops\": {\n");
+    for(int i = 0; i < FS_NOPS; i++){
+        const struct fs_op_stats *s = &stats->ops[i];
+        fprintf(out, "    \"%s\": {\"calls\": %lld, \"errors\": %lld, \"total_ns\": %lld, \"max_ns\": %lld, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f, \"disk_reads\": %lld, \"disk_writes\": %lld, \"histogram_us\": {",
+                fs_op_name(i), s->calls, s->errors, s->total_ns, s->max_ns,
+                fs_stats_percentile(s, 50), fs_stats_percentile(s, 99), s->disk_reads, s->disk_writes);
+
+        // Only the buckets in use, keyed by their upper edge
+        int first = 1;
+        for(int b = 0; b < FS_STATS_BUCKETS; b++){
+            if(!s->histogram[b]) continue;
+            fprintf(out, "%s\"%lld\": %lld", first ? "" : ", ", 1LL << b, s->histogram[b]);
+            first = 0;
+        }
+        fprintf(out, "}}%s\n", i < FS_NOPS - 1 ? "," : "");
+    }
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"logical_read_bytes\": %lld,\n", stats->logical_read_bytes);
+    fprintf(out, "  \"logical_write_bytes\": %lld,\n", stats->logical_write_bytes);
+    fprintf(out, "  \"physical_read_bytes\": %lld,\n", stats->physical_read_bytes);
+    fprintf(out, "  \"physical_write_bytes\": %lld\n", stats->physical_write_bytes);
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,20 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <time.h>
+
+// Instrumentation behind fs_stats. Each public fs_* call is bracketed
+// with stats_begin/stats_end, which time it and charge it with the disk
+// blocks its thread asked for in between.
+
+struct stats_call {
+    struct timespec started;
+    long long reads;        // disk_thread_counts at the start
+    long long writes;
+};
+
+void stats_begin( struct stats_call *call );
+void stats_end( struct stats_call *call, int op, int ok );
+void stats_bytes( long long read, long long written );
+
+#endif
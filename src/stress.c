@@ -0,0 +1,164 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+Multi-threaded stress test for the fs_* API. Each worker repeatedly
+creates a file, writes it, reads it back, checks the contents, and
+deletes it. The run is repeated with 1, 2, 4... threads up to the
+limit given, and the throughput of each is reported. First, a file
+small enough to be kept in its inode is checked to take no blocks once
+the page buffer has been flushed. The runs themselves go without the
+page buffer: a whole file fits in it and would be deleted before ever
+reaching the allocator or the disk.
+*/
+
+#define STRESS_FILE_SIZE (16*DISK_BLOCK_SIZE)
+#define STRESS_SECONDS 2.0
+#define STRESS_INLINE_SIZE 19
+
+struct worker {
+	int id;
+	int ops;
+	int errors;
+	pthread_t thread;
+};
+
+static int running;
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static void *worker_main( void *arg )
+{
+	struct worker *w = arg;
+	char *out = malloc(STRESS_FILE_SIZE);
+	char *in = malloc(STRESS_FILE_SIZE);
+	int i, round = 0;
+
+	while(__atomic_load_n(&running,__ATOMIC_RELAXED)) {
+		for(i=0;i<STRESS_FILE_SIZE;i++) out[i] = w->id*31 + round + i;
+
+		int inumber = fs_create();
+		if(!inumber) {
+			w->errors++;
+			continue;
+		}
+		if(fs_write(inumber,out,STRESS_FILE_SIZE,0)!=STRESS_FILE_SIZE
+		   || fs_read(inumber,in,STRESS_FILE_SIZE,0)!=STRESS_FILE_SIZE
+		   || memcmp(in,out,STRESS_FILE_SIZE)) {
+			w->errors++;
+		}
+		fs_delete(inumber);
+
+		w->ops++;
+		round++;
+	}
+
+	free(out);
+	free(in);
+	return 0;
+}
+
+static int check_inline()
+{
+	char out[STRESS_INLINE_SIZE], in[STRESS_INLINE_SIZE];
+	int i, inumber, ok;
+	int64_t blocks;
+
+	for(i=0;i<STRESS_INLINE_SIZE;i++) out[i] = 'a'+i;
+	inumber = fs_create();
+	if(!inumber) {
+		printf("inline file: create failed\n");
+		return 1;
+	}
+	ok = fs_write(inumber,out,STRESS_INLINE_SIZE,0)==STRESS_INLINE_SIZE;
+	fs_sync();
+	blocks = fs_getblocks(inumber);
+	ok = ok && fs_read(inumber,in,STRESS_INLINE_SIZE,0)==STRESS_INLINE_SIZE
+		&& !memcmp(in,out,STRESS_INLINE_SIZE) && blocks==0;
+	fs_delete(inumber);
+
+	printf("inline file: %d bytes in %lld blocks, %s\n",
+		STRESS_INLINE_SIZE,(long long)blocks,ok ? "ok" : "FAILED");
+	return !ok;
+}
+
+static int run( int nthreads )
+{
+	struct worker *workers = calloc(nthreads,sizeof(struct worker));
+	int i, ops = 0, errors = 0;
+	double started, elapsed;
+
+	__atomic_store_n(&running,1,__ATOMIC_RELAXED);
+	started = now();
+	for(i=0;i<nthreads;i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread,0,worker_main,&workers[i]);
+	}
+	usleep(STRESS_SECONDS*1e6);
+	__atomic_store_n(&running,0,__ATOMIC_RELAXED);
+	for(i=0;i<nthreads;i++) {
+		pthread_join(workers[i].thread,0);
+		ops += workers[i].ops;
+		errors += workers[i].errors;
+	}
+	elapsed = now()-started;
+	free(workers);
+
+	printf("%3d threads: %8.0f files/s (%.1f MB/s written and read back), %d errors\n",
+		nthreads, ops/elapsed, ops*(double)STRESS_FILE_SIZE/elapsed/1e6, errors);
+	return errors;
+}
+
+int main( int argc, char *argv[] )
+{
+	int maxthreads, nthreads, errors = 0;
+
+	if(argc!=3 && argc!=4) {
+		printf("use: %s <diskfile> <nblocks> [maxthreads]\n",argv[0]);
+		return 1;
+	}
+	maxthreads = argc==4 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if(maxthreads<1) maxthreads = 1;
+
+	if(!disk_init(argv[1],atoi(argv[2]))) {
+		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+	if(!disk_async_init(DISK_ASYNC_AUTO)) {
+		printf("couldn't start the async disk engine\n");
+		return 1;
+	}
+
+	/* The filesystem logs every write; keep the report readable
+	 * but let its errors through. */
+	fs_set_verbose(0);
+	setvbuf(stdout,0,_IOLBF,0);
+
+	if(!fs_format() || !fs_mount()) {
+		printf("couldn't format and mount %s\n",argv[1]);
+		return 1;
+	}
+
+	errors += check_inline();
+	fs_set_delalloc(0);
+	for(nthreads=1;nthreads<maxthreads;nthreads*=2) errors += run(nthreads);
+	errors += run(maxthreads);
+
+	fs_unmount();
+	disk_close();
+	return errors!=0;
+}